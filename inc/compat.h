@@ -16,6 +16,10 @@
 #define DEFFILEMODE (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH)
 #endif
 
+#ifndef DTTOIF
+#define DTTOIF(x) ((x) << 12)
+#endif
+
 #ifndef PRIO_MIN
 #define PRIO_MIN -NZERO
 #endif
@@ -2,6 +2,10 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86
+#endif
+
 #define LOAD32H(x, y) \
 do { x = ((uint32_t)((y)[0] & 255)<<24) | \
          ((uint32_t)((y)[1] & 255)<<16) | \
@@ -59,17 +63,44 @@ union hash_state {
 	struct sha1_state sha1;
 };
 
+#define MBLANES 8 /* independent messages in the lanes functions */
+
+/* n blocks of each in[i] into md[i], for MBLANES messages at once */
+typedef void lanefn(union hash_state **, const uint8_t **, size_t);
+
 struct crypto {
 	union hash_state *md;
 	void (*init)(union hash_state *);
 	void (*process)(union hash_state *, uint8_t *, unsigned long);
 	void (*done)(union hash_state *, uint8_t *);
+	lanefn *lanes;   /* many small files hash faster, or NULL */
+	int jobs;        /* files hashed at once on threads */
 	size_t bsiz;
 	uint8_t *buf;
 };
 
+struct sumjob {
+	const char *name;
+	int fd;          /* or -1 to open name, else read in order */
+	int err;         /* reported already */
+	uint8_t sum[64];
+};
+
+enum {
+	CPU_SSSE3 = 0x1,
+	CPU_SSE41 = 0x2,
+	CPU_SHA   = 0x4,
+	CPU_AVX2  = 0x8,
+	CPU_BMI2  = 0x10
+};
+
+int cpu_has(int);
+
+int crypto_byname(struct crypto *, const char *);
+int crypto_sum(struct crypto *, int, const char *);
+void crypto_sumv(struct crypto *, struct sumjob *, size_t);
 int crypto_check(struct crypto *, FILE *, const char *);
-int crypto_print(struct crypto *, FILE *, const char *);
+int crypto_print(struct crypto *, char **, int);
 
 void sha1_init(union hash_state *);
 void sha1_process(union hash_state *, uint8_t *, unsigned long);
@@ -81,6 +112,7 @@ void sha224_done(union hash_state *, uint8_t *);
 void sha256_init(union hash_state *);
 void sha256_process(union hash_state *, uint8_t *, unsigned long);
 void sha256_done(union hash_state *, uint8_t *);
+lanefn *sha256_lanes(void);
 
 void sha512_init(union hash_state *);
 void sha512_process(union hash_state *, uint8_t *, unsigned long);
@@ -5,6 +5,7 @@
 #include <inttypes.h>
 #include <dirent.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "arg.h"
 #include "compat.h"
@@ -15,8 +16,23 @@
 #define LEN(a)       (sizeof((a))/sizeof((a)[0]))
 
 enum cp_flags {
-	CP_FFLAG = 0x1, /* force copy */
-	CP_PFLAG = 0x2  /* preserve permissions */
+	CP_FFLAG   = 0x1, /* force copy */
+	CP_PFLAG   = 0x2, /* preserve permissions */
+	CP_RAUTO   = 0x4, /* clone the data when the filesystem can */
+	CP_RALWAYS = 0x8, /* clone the data or fail */
+	CP_RNEVER  = 0x10, /* never share the data with the source */
+	CP_SALWAYS = 0x20, /* turn zero filled blocks into holes */
+	CP_SNEVER  = 0x40, /* fill the holes of sparse files */
+	CP_UPDATE  = 0x80, /* skip files copied before, same size and mtime */
+	CP_NEWER   = 0x100, /* or a newer target */
+	CP_SUM     = 0x200, /* same size and digest instead of mtime */
+	CP_MOVE    = 0x400  /* remove each source directory once it is safe */
+};
+
+enum cat_flags {
+	CAT_SHARE = 0x1, /* the data may end up shared with the source */
+	CAT_HOLES = 0x2, /* recreate the holes of regular files */
+	CAT_ZEROS = 0x4  /* and make holes out of zero filled blocks */
 };
 
 enum fs_ret {
@@ -26,26 +42,126 @@ enum fs_ret {
 	FS_CONT =  1  /* dir already accessed */
 };
 
+enum fs_need {
+	FS_TYPE    = 0x001, /* file type (d_type) */
+	FS_MODE    = 0x002, /* permission bits */
+	FS_NLINK   = 0x004,
+	FS_OWNER   = 0x008, /* uid and gid */
+	FS_TIME    = 0x010, /* atime, mtime and ctime */
+	FS_INO     = 0x020,
+	FS_SIZE    = 0x040,
+	FS_BLOCKS  = 0x080,
+	FS_STAT    = 0x0fe, /* everything else */
+	FS_NOSYNC  = 0x100, /* cached attributes are good enough */
+	FS_INOSORT = 0x200 /* stat a batch of entries in inode order */
+};
+
+struct arena {
+	struct chunk *chunks;
+	char *p;
+	size_t left;
+	size_t size;   /* doubles with every chunk */
+};
+
 struct histnode {
-	struct histnode *next;
 	dev_t dev;
 	ino_t ino;
+	int used;
+};
+
+struct fs_hist {
+	pthread_mutex_t lock;
+	struct arena arena;
+	struct histnode *tab;
+	size_t cap;
+	size_t len;
+};
+
+struct fs_ent {
+	struct stat info;
+	ino_t ino;
+	size_t nlen;
+	size_t off;    /* name in the pool */
+	int err;       /* errno of the stat */
 };
 
 typedef struct {
 	struct stat info;
+	dev_t dev;
+	ino_t ino;
 	size_t dlen;
 	size_t nlen;
+	size_t pcap;
 	size_t plen;
-	DIR *dirp;
+	DIR *dirp;     /* only without getdents64 */
+	char *dbuf;    /* raw entries */
+	size_t dbcap;
+	size_t dbpos;
+	size_t dbend;
+	struct fs_ent *ents;
+	struct fs_ent **ord;
+	size_t ecap;
+	size_t nent;
+	size_t cur;
+	size_t ncap;
+	char *pool;
+	struct fs_hist *hist;
+	int depth;
+	int fd;
 	char *dir;
 	char *name;
-	char path[PATH_MAX];
+	char *path;
 } FS_DIR;
 
-extern struct histnode *fs_hist;
+typedef struct fs_node FS_NODE;
+
+struct fs_node {
+	struct stat info;
+	FS_NODE *parent;
+	FS_NODE *child;
+	FS_NODE *last;
+	FS_NODE *next;
+	FS_NODE *lprev;  /* descriptor cache */
+	FS_NODE *lnext;
+	FS_DIR *dir;     /* while the entries are read */
+	FILE *out;       /* output of this directory */
+	void *data;      /* inherited from the parent */
+	char *name;      /* relative to the parent */
+	char *path;      /* only valid in the callbacks */
+	char *obuf;      /* written while the entries were read */
+	char *tbuf;      /* written by post */
+	size_t nlen;
+	size_t olen;
+	size_t tlen;
+	off_t total;     /* summed into the parent */
+	dev_t dev;
+	ino_t ino;
+	long pending;
+	int at;          /* parent descriptor, only valid in post */
+	int fd;          /* kept while subdirectories are pending */
+	int tfd;         /* same directory in the mirror tree */
+	int users;
+	int depth;
+	int read;        /* the entries were read */
+	int ready;       /* what of its output is final */
+	int rval;        /* or'ed into the parent */
+};
+
+struct fs_walk {
+	int  (*pre)(FS_NODE *);            /* directory opened */
+	int  (*visit)(FS_NODE *, FS_DIR *); /* FS_EXEC descends */
+	void (*scan)(FS_NODE *);           /* entries read */
+	int  (*post)(FS_NODE *);           /* subdirectories done */
+	void *data;
+	const char *mirror; /* tree opened alongside, see tfd */
+	int need;
+	int jobs;           /* threads walking, fs_jobs when 0 */
+};
+
 extern int fs_follow;
+extern int fs_jobs;
 extern int chown_hflag;
+extern const char *cp_verify;
 
 /* chmod.c */
 int chmodfile(const char *, mode_t, int);
@@ -56,7 +172,9 @@ int chownfile(const char *, uid_t, gid_t, int);
 int chowndir(const char *, uid_t, gid_t, int);
 
 /* concat.c */
-int concat(int, const char *, int, const char *);
+struct crypto;
+#define concat(a, b, c, d) concat_((a), (b), (c), (d), CAT_SHARE, NULL)
+int concat_(int, const char *, int, const char *, int, struct crypto *);
 
 /* cp.c */
 int cpfile(const char *, const char *, int, int);
@@ -64,12 +182,22 @@ int cpdir(const char *, const char *, int, int);
 
 /* dir.c */
 int  open_dir(FS_DIR *, const char *);
-int  read_dir(FS_DIR *);
+int  open_dirat(FS_DIR *, FS_DIR *, int, const char *, const char *);
+int  read_dir(FS_DIR *, int);
 void close_dir(FS_DIR *);
 
 /* ealloc.c */
 void * emalloc(size_t);
 char * estrdup(const char *);
+void * arena_alloc(struct arena *, size_t);
+char * arena_strdup(struct arena *, const char *);
+void   arena_reset(struct arena *);
+
+/* iobuf.c */
+void   ioadvise(int);
+size_t iosize(int);
+char * iobuf(void);
+void   iodone(int);
 
 /* fgetline.c */
 ssize_t fgetline(char *, size_t, FILE *);
@@ -93,5 +221,24 @@ mode_t strtomode(const char *, mode_t);
 void pathcat_(char *, size_t, const char *, const char *);
 void pathcatx_(char *, size_t, const char *, const char *);
 
+/* rm.c */
+int delfile(const char *, int);
+int deldir(const char *, int);
+
+/* uring.c */
+void fs_statv(int, struct fs_ent **, const char *, size_t, int, int);
+void fs_unlinkv(int, char **, int *, size_t);
+
+/* walk.c */
+int  walk(const char *, struct fs_walk *);
+void walk_push(FS_NODE *, const char *, struct stat *);
+
+/* stat.c */
+int fs_stat(int, const char *, struct stat *, int, int);
+#ifdef STATX_TYPE
+unsigned int statxmask(int);
+void statxfill(struct stat *, struct statx *);
+#endif
+
 /* stoll.c */
 long long strtobase(const char *, long long, unsigned long, int);
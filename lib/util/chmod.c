@@ -2,15 +2,36 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "util.h"
 
+static int
+visit(FS_NODE *n, FS_DIR *dir)
+{
+	mode_t mode;
+
+	if (ISDOT(dir->name) || S_ISLNK(dir->info.st_mode))
+		return FS_OK;
+
+	mode = *(mode_t *)n->data;
+
+	if (fchmodat(dir->fd, dir->name,
+	    mode ? mode : dir->info.st_mode, 0) < 0) {
+		warn("chmod %s", dir->path);
+		n->rval = 1;
+	}
+
+	return FS_EXEC;
+}
+
 int
 chmodfile(const char *s, mode_t mode, int depth)
 {
 	struct stat st;
 
-	if ((FS_FOLLOW(depth) ? stat : lstat)(s, &st) < 0) {
+	if (fs_stat(AT_FDCWD, s, &st, FS_FOLLOW(depth) ? 0 : AT_SYMLINK_NOFOLLOW,
+	    mode ? FS_TYPE : FS_MODE) < 0) {
 		warn("(l)stat %s", s);
 		return 1;
 	}
@@ -26,44 +47,27 @@ chmodfile(const char *s, mode_t mode, int depth)
 int
 chmoddir(const char *s, mode_t mode, int depth)
 {
-	FS_DIR dir;
-	int rd, rval;
+	struct fs_walk w;
+	int rval;
 
-	rval = 0;
+	w = (struct fs_walk){
+		.visit = visit,
+		.data  = &mode,
+		.need  = mode ? FS_TYPE : FS_MODE,
+	};
 
-	switch (open_dir(&dir, s)) {
+	rval = chmodfile(s, mode, depth);
+
+	switch (walk(s, &w)) {
 	case FS_ERR:
 		if (errno != ENOTDIR) {
 			warn("open_dir %s", s);
 			return 1;
 		}
-		rval = chmodfile(s, mode, depth);
-		/* fallthrough */
-	case FS_CONT:
+		return rval;
+	case FS_OK:
 		return rval;
 	}
 
-	depth++;
-	while ((rd = read_dir(&dir)) == FS_EXEC) {
-		if (ISDOT(dir.name))
-			continue;
-
-		if (chmod(s, mode ? mode : dir.info.st_mode) < 0) {
-			warn("chmod %s", s);
-			rval = 1;
-		}
-
-		if (S_ISDIR(dir.info.st_mode))
-			rval |= chmoddir(dir.path, mode, depth);
-	}
-	depth--;
-
-	close_dir(&dir);
-
-	if (rd == FS_ERR) {
-		warn("read_dir %s", dir.path);
-		return 1;
-	}
-
-	return rval;
+	return 1;
 }
@@ -3,23 +3,28 @@
 #include <err.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "util.h"
 
+struct owner {
+	uid_t uid;
+	gid_t gid;
+};
+
 int chown_hflag;
 
 static int
-afile(const char *s, uid_t uid, gid_t gid, int depth, struct stat *st)
+afile(int fd, const char *name, const char *s, uid_t uid, gid_t gid,
+      struct stat *st)
 {
-	int (*chownf)(const char *, uid_t, gid_t);
+	int flags;
 
-	if (!S_ISLNK(st->st_mode))
-		chownf = chown;
-	else
-		chownf = lchown;
+	flags = S_ISLNK(st->st_mode) ? AT_SYMLINK_NOFOLLOW : 0;
 
-	if (chownf(s, (uid == (uid_t)-1) ? st->st_uid : uid, gid) < 0) {
+	/* an id of -1 is left untouched, no need to stat for it */
+	if (fchownat(fd, name, uid, gid, flags) < 0) {
 		warn("(l)chown %s", s);
 		return 1;
 	}
@@ -27,58 +32,62 @@ afile(const char *s, uid_t uid, gid_t gid, int depth, struct stat *st)
 	return 0;
 }
 
+static int
+visit(FS_NODE *n, FS_DIR *dir)
+{
+	struct owner *o;
+
+	if (ISDOT(dir->name))
+		return FS_OK;
+
+	o = n->data;
+	n->rval |= afile(dir->fd, dir->name, dir->path, o->uid, o->gid,
+	                 &dir->info);
+
+	return FS_EXEC;
+}
+
 int
 chownfile(const char *s, uid_t uid, gid_t gid, int depth)
 {
 	struct stat st;
 
-	if ((FS_FOLLOW(depth) ||
-	    (chown_hflag & !depth) ? stat : lstat)(s, &st) < 0) {
+	if (fs_stat(AT_FDCWD, s, &st, (FS_FOLLOW(depth) ||
+	    (chown_hflag & !depth)) ? 0 : AT_SYMLINK_NOFOLLOW, FS_TYPE) < 0) {
 		warn("(l)stat %s", s);
 		return 1;
 	}
 
-	return afile(s, uid, gid, depth, &st);
+	return afile(AT_FDCWD, s, s, uid, gid, &st);
 }
 
 int
 chowndir(const char *s, uid_t uid, gid_t gid, int depth)
 {
-	FS_DIR dir;
-	int rd, rval;
+	struct fs_walk w;
+	struct owner o;
+	int rval;
+
+	o.uid = uid;
+	o.gid = gid;
+	w = (struct fs_walk){
+		.visit = visit,
+		.data  = &o,
+		.need  = FS_TYPE,
+	};
 
-	rval = 0;
+	rval = chownfile(s, uid, gid, depth);
 
-	switch (open_dir(&dir, s)) {
+	switch (walk(s, &w)) {
 	case FS_ERR:
 		if (errno != ENOTDIR) {
 			warn("open_dir %s", s);
 			return 1;
 		}
-		rval = chownfile(s, uid, gid, depth);
-		/* fallthrough */
-	case FS_CONT:
+		return rval;
+	case FS_OK:
 		return rval;
 	}
 
-	depth++;
-	while ((rd = read_dir(&dir)) == FS_EXEC) {
-		if (ISDOT(dir.name))
-			continue;
-
-		rval |= afile(s, uid, gid, depth, &dir.info);
-
-		if (S_ISDIR(dir.info.st_mode))
-			rval |= chowndir(s, uid, gid, depth);
-	}
-	depth--;
-
-	close_dir(&dir);
-
-	if (rd == FS_ERR) {
-		warn("read_dir %s", dir.path);
-		return 1;
-	}
-
-	return rval;
+	return 1;
 }
@@ -1,19 +1,112 @@
+#include <sys/stat.h>
+
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "crypto.h"
 #include "util.h"
 
-int
-concat(int f1, const char *s1, int f2, const char *s2)
+#define CHUNK   (1 << 30)
+#define ZBLOCK  4096
+
+#ifdef __linux__
+enum {
+	COPYRANGE,
+	SENDFILE,
+	SPLICE
+};
+
+/*
+ * move the data inside the kernel until the end of the input, or until
+ * *len bytes are moved when it is not negative. -1 when the path does not
+ * apply or fails. the offsets and *len follow what was moved, so
+ * read/write can take over at any point and report the real error.
+ */
+static ssize_t
+kcopy(int f1, int f2, int how, off_t *len)
 {
 	ssize_t n;
-	char buf[BUFSIZ];
+	size_t max;
 
-	while ((n = read(f1, buf, sizeof(buf))) > 0) {
-		if (write(f2, buf, n) != n) {
-			warn("write %s", s2);
-			return -2;
+	do {
+		if (!(max = (*len < 0) ? CHUNK : MIN(*len, CHUNK)))
+			return 0;
+
+		switch (how) {
+		case COPYRANGE:
+			n = copy_file_range(f1, NULL, f2, NULL, max, 0);
+			break;
+		case SENDFILE:
+			n = sendfile(f2, f1, NULL, max);
+			break;
+		default:
+			n = splice(f1, NULL, f2, NULL, max, SPLICE_F_MOVE);
+		}
+
+		if (n > 0 && *len > 0)
+			*len -= n;
+	} while (n > 0);
+
+	return n;
+}
+#endif
+
+static int
+zero(const char *p, size_t len)
+{
+	return !p[0] && !memcmp(p, p + 1, len - 1);
+}
+
+/*
+ * len < 0 copies up to the end, zeros skips every zero filled block and
+ * h, when given, is fed everything read
+ */
+static int
+rwcopy(int f1, const char *s1, int f2, const char *s2, off_t len, int zeros,
+       struct crypto *h)
+{
+	ssize_t n, w;
+	size_t blk, bsz, off;
+	char *buf;
+
+	n   = 0;
+	buf = iobuf();
+	bsz = iosize(f1);
+
+	while (len && (n = read(f1, buf,
+	    (len < 0) ? bsz : MIN(len, bsz))) > 0) {
+		if (len > 0)
+			len -= n;
+		if (h)
+			h->process(h->md, (uint8_t *)buf, n);
+
+		for (off = 0; off < (size_t)n; off += w) {
+			blk = n - off;
+			if (zeros) {
+				blk = MIN(blk, ZBLOCK - (off % ZBLOCK));
+				if (zero(buf + off, blk)) {
+					if (lseek(f2, blk, SEEK_CUR) < 0) {
+						warn("lseek %s", s2);
+						return -2;
+					}
+					w = blk;
+					continue;
+				}
+			}
+
+			if ((w = write(f2, buf + off, blk)) < 0) {
+				warn("write %s", s2);
+				return -2;
+			}
 		}
 	}
 
@@ -24,3 +117,129 @@ concat(int f1, const char *s1, int f2, const char *s2)
 
 	return 0;
 }
+
+/* copy the data extents of f1 and leave holes in f2 everywhere else */
+static int
+sparse(int f1, const char *s1, int f2, const char *s2, off_t end, int flags)
+{
+	off_t data, hole, len, pos;
+	int rval;
+
+	for (pos = 0; pos < end; pos = hole) {
+		if ((data = lseek(f1, pos, SEEK_DATA)) < 0) {
+			if (errno == ENXIO)
+				break;
+			if (errno != EINVAL) {
+				warn("lseek %s", s1);
+				return -1;
+			}
+			/* no extent map, the rest is data */
+			data = pos;
+			hole = end;
+		} else if ((hole = lseek(f1, data, SEEK_HOLE)) < 0) {
+			hole = end;
+		}
+
+		if (data >= end)
+			break;
+		hole = MIN(hole, end);
+		len  = hole - data;
+
+		if (lseek(f1, data, SEEK_SET) < 0) {
+			warn("lseek %s", s1);
+			return -1;
+		}
+		if (lseek(f2, data, SEEK_SET) < 0) {
+			warn("lseek %s", s2);
+			return -2;
+		}
+
+#ifdef __linux__
+		if ((flags & CAT_SHARE) && !(flags & CAT_ZEROS))
+			kcopy(f1, f2, COPYRANGE, &len);
+#endif
+		if ((rval = rwcopy(f1, s1, f2, s2, len, flags & CAT_ZEROS,
+		    NULL)) < 0)
+			return rval;
+	}
+
+	/* the trailing hole */
+	if (ftruncate(f2, end) < 0) {
+		warn("ftruncate %s", s2);
+		return -2;
+	}
+
+	return 0;
+}
+
+/* h sees the data on its way, the kernel cannot show it */
+static int
+hashcopy(int f1, const char *s1, int f2, const char *s2, int zeros,
+         struct crypto *h)
+{
+	off_t end;
+	int rval;
+
+	h->init(h->md);
+
+	if ((rval = rwcopy(f1, s1, f2, s2, -1, zeros, h)) < 0)
+		return rval;
+
+	/* a trailing zero block was skipped, not written */
+	if (zeros && ((end = lseek(f2, 0, SEEK_CUR)) < 0 ||
+	    ftruncate(f2, end) < 0)) {
+		warn("ftruncate %s", s2);
+		return -2;
+	}
+
+	h->done(h->md, h->buf);
+
+	return 0;
+}
+
+int
+concat_(int f1, const char *s1, int f2, const char *s2, int flags,
+        struct crypto *h)
+{
+	struct stat st1, st2;
+	off_t len;
+	int rval;
+
+	/* once here, rwcopy may run for each extent of a sparse file */
+	ioadvise(f1);
+
+	len = -1;
+	if (h) {
+		rval = hashcopy(f1, s1, f2, s2, (flags & (CAT_HOLES|CAT_ZEROS)) &&
+		    fstat(f1, &st1) == 0 && fstat(f2, &st2) == 0 &&
+		    S_ISREG(st1.st_mode) && S_ISREG(st2.st_mode), h);
+		iodone(f1);
+		return rval;
+	}
+
+	if (fstat(f1, &st1) == 0 && fstat(f2, &st2) == 0) {
+		if ((flags & (CAT_HOLES|CAT_ZEROS)) &&
+		    S_ISREG(st1.st_mode) && S_ISREG(st2.st_mode)) {
+			rval = sparse(f1, s1, f2, s2, st1.st_size, flags);
+			iodone(f1);
+			return rval;
+		}
+#ifdef __linux__
+		/* copy_file_range may not cross filesystems on old kernels */
+		if (S_ISREG(st1.st_mode) && S_ISREG(st2.st_mode)) {
+			if (!(flags & CAT_SHARE) ||
+			    kcopy(f1, f2, COPYRANGE, &len) < 0)
+				kcopy(f1, f2, SENDFILE, &len);
+		} else if (S_ISREG(st1.st_mode))
+			kcopy(f1, f2, SENDFILE, &len);
+		else if (S_ISFIFO(st1.st_mode) || S_ISFIFO(st2.st_mode))
+			kcopy(f1, f2, SPLICE, &len);
+#endif
+	}
+
+	/* some pseudo files claim to be empty, read has the last word */
+	rval = rwcopy(f1, s1, f2, s2, -1, 0, NULL);
+	iodone(f1);
+
+	return rval;
+}
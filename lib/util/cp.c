@@ -1,36 +1,186 @@
 #include <sys/stat.h>
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "crypto.h"
 #include "util.h"
 
+#define LDIRMAX 64 /* target directories kept open for links */
+#define MVBYTES (1LL << 30) /* copied before the target is flushed */
+#define MVFILES 8192
+
+enum {
+	LPENDING, /* the first link is being copied */
+	LDONE,
+	LFAILED
+};
+
+/* a target directory holding first copies, shared by their links */
+struct ldir {
+	dev_t dev;
+	ino_t ino;
+	int fd;
+	int refs;
+};
+
+struct link {
+	dev_t dev;
+	ino_t ino;
+	struct ldir *dir;  /* where the first link went, name in it */
+	char *name;
+	char *path;        /* the same, once dir is gone or full */
+	nlink_t left;      /* links not seen yet */
+	int state;
+};
+
+/* files with more than one link, by source inode */
+struct links {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct ldir dirs[LDIRMAX];
+	struct link *tab;
+	size_t cap;
+	size_t len;
+};
+
 struct copy {
+	struct links *links;
 	struct stat *st;
 	int opts;
+	int sfd;
+	int tfd;
 	const char *src;
 	const char *dest;
+	const char *sname;
+	const char *tname;
+};
+
+struct job {
+	struct stat st;
+	char *src;
+	char *dest;
+	size_t off;    /* of the name in src */
+	int sfd;
+	int tfd;
+};
+
+struct slot {
+	int busy;      /* jobs not done yet */
+	int rval;
+};
+
+/* files copied by workers while the walk goes on */
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t more;  /* a job was queued */
+	pthread_cond_t room;  /* a job was taken */
+	pthread_cond_t idle;  /* a directory has no jobs left */
+	pthread_t *tid;
+	struct job *q;
+	struct slot *slots;   /* by source directory descriptor */
+	int nslots;
+	int cap;
+	int head;
+	int len;
+	int nthreads;
+	int opts;
+	int done;
+	struct links *links;
 };
 
+/* a source directory to remove once its copy is on disk */
+struct mvdir {
+	char *src;
+	char *dest;
+};
+
+struct target {
+	struct links links;
+	struct links made;    /* directories this copy created */
+	struct pool *pool;
+	struct mvdir *mv;     /* in the order they were finished */
+	const char *path;
+	size_t slen;
+	size_t mvlen;
+	size_t mvcap;
+	size_t mvfiles;       /* copied since the last flush */
+	long long mvbytes;
+	mode_t mask;
+	int opts;
+};
+
+const char *cp_verify; /* hash every copy is checked with */
+
 /* internal functions */
+static int
+reflink(int sf, int tf)
+{
+#ifdef FICLONE
+	return ioctl(tf, FICLONE, sf);
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/* read the target back past the page cache, it must hash to h->buf */
+static int
+verify(struct copy *cp, struct crypto *h)
+{
+	uint8_t sum[64], *want;
+	int fd, rval;
+
+	if ((fd = openat(cp->tfd, cp->tname, O_RDONLY|O_DIRECT|O_CLOEXEC)) < 0 &&
+	    (errno != EINVAL ||
+	    (fd = openat(cp->tfd, cp->tname, O_RDONLY|O_CLOEXEC)) < 0)) {
+		warn("open %s", cp->dest);
+		return 1;
+	}
+
+	want   = h->buf;
+	h->buf = sum;
+	rval   = crypto_sum(h, fd, cp->dest);
+	h->buf = want;
+	close(fd);
+
+	if (!rval && memcmp(sum, want, h->bsiz)) {
+		warnx("%s: checksum mismatch", cp->dest);
+		rval = 1;
+	}
+
+	return rval;
+}
+
 static int
 copy_reg(struct copy *cp)
 {
+	struct crypto h;
 	struct stat st;
 	struct timespec times[2];
-	int rval, sf, tf;
+	union hash_state md;
+	uint8_t sum[64];
+	int flags, rval, sf, tf;
 
 	rval =  0;
 	sf   = -1;
 	tf   = -1;
 
-	if ((sf = open(cp->src, O_RDONLY, 0)) < 0) {
+	if ((sf = openat(cp->sfd, cp->sname, O_RDONLY, 0)) < 0) {
 		warn("open %s", cp->src);
 		goto failure;
 	}
@@ -46,21 +196,47 @@ copy_reg(struct copy *cp)
 		goto failure;
 	}
 
-	if ((tf = open(cp->dest, O_WRONLY|O_CREAT|O_EXCL, 0)) < 0) {
+	if ((tf = openat(cp->tfd, cp->tname,
+	    O_WRONLY|O_CREAT|O_EXCL, 0)) < 0) {
 		warn("open %s", cp->dest);
 		goto failure;
 	}
 
-	if (concat(sf, cp->src, tf, cp->dest) < 0)
-		goto failure;
+	/* on copy-on-write filesystems the data can be shared at once */
+	if (!((CP_RAUTO|CP_RALWAYS) & cp->opts) || reflink(sf, tf) < 0) {
+		if (CP_RALWAYS & cp->opts) {
+			warn("clone %s -> %s", cp->src, cp->dest);
+			goto failure;
+		}
+
+		flags = (CP_RNEVER & cp->opts) ? 0 : CAT_SHARE;
+		if (CP_SALWAYS & cp->opts)
+			flags |= CAT_HOLES|CAT_ZEROS;
+		else if (!(CP_SNEVER & cp->opts) &&
+		    st.st_blocks * 512 < st.st_size)
+			flags |= CAT_HOLES;
+
+		if (cp_verify) {
+			crypto_byname(&h, cp_verify);
+			h.md  = &md;
+			h.buf = sum;
+		}
+
+		if (concat_(sf, cp->src, tf, cp->dest, flags,
+		    cp_verify ? &h : NULL) < 0)
+			goto failure;
+
+		if (cp_verify && verify(cp, &h))
+			goto failure;
+	}
 
 	fchmod(tf, st.st_mode);
 	if (CP_PFLAG & cp->opts) {
 		times[0] = st.st_atim;
 		times[1] = st.st_mtim;
 
-		if ((utimensat(AT_FDCWD, cp->dest, times, 0)) < 0) {
-			warn("utimensat %s", cp->dest);
+		if ((futimens(tf, times)) < 0) {
+			warn("futimens %s", cp->dest);
 			goto failure;
 		}
 
@@ -88,7 +264,7 @@ copy_lnk(struct copy *cp)
 	ssize_t rl;
 	char path[PATH_MAX];
 
-	if ((rl = readlink(cp->src, path, sizeof(path)-1)) < 0) {
+	if ((rl = readlinkat(cp->sfd, cp->sname, path, sizeof(path)-1)) < 0) {
 		warn("readlink %s", cp->src);
 		return 1;
 	}
@@ -99,13 +275,14 @@ copy_lnk(struct copy *cp)
 		return 1;
 	}
 
-	if (symlink(path, cp->dest) < 0) {
+	if (symlinkat(path, cp->tfd, cp->tname) < 0) {
 		warn("symlink %s -> %s", cp->dest, path);
 		return 1;
 	}
 
 	if ((CP_PFLAG & cp->opts) &&
-	    lchown(cp->dest, cp->st->st_uid, cp->st->st_gid) < 0) {
+	    fchownat(cp->tfd, cp->tname, cp->st->st_uid, cp->st->st_gid,
+	    AT_SYMLINK_NOFOLLOW) < 0) {
 		warn("lchown %s", cp->dest);
 		return 1;
 	}
@@ -116,7 +293,7 @@ copy_lnk(struct copy *cp)
 static int
 copy_spc(struct copy *cp)
 {
-	if (mknod(cp->dest, cp->st->st_mode, cp->st->st_dev) < 0) {
+	if (mknodat(cp->tfd, cp->tname, cp->st->st_mode, cp->st->st_rdev) < 0) {
 		warn("mknod %s", cp->dest);
 		return 1;
 	}
@@ -124,106 +301,789 @@ copy_spc(struct copy *cp)
 	return 0;
 }
 
+static struct link *
+linkslot(struct links *ls, dev_t dev, ino_t ino)
+{
+	struct link *l;
+	uint64_t h;
+	size_t i;
+
+	h  = (uint64_t)ino * 0x9e3779b97f4a7c15ULL;
+	h ^= (uint64_t)dev + (h >> 29);
+
+	for (i = (size_t)(h ^ (h >> 32)) & (ls->cap - 1);;
+	    i = (i + 1) & (ls->cap - 1)) {
+		l = &ls->tab[i];
+		if (!l->path || (l->dev == dev && l->ino == ino))
+			return l;
+	}
+}
+
+static void
+linkgrow(struct links *ls)
+{
+	struct link *l, *otab;
+	size_t i, ocap;
+
+	otab = ls->tab;
+	ocap = ls->cap;
+
+	ls->cap = ocap ? ocap << 1 : 64;
+	ls->tab = emalloc(ls->cap * sizeof(*ls->tab));
+	memset(ls->tab, 0, ls->cap * sizeof(*ls->tab));
+
+	for (i = 0; i < ocap; i++) {
+		if (!otab[i].path)
+			continue;
+		l  = linkslot(ls, otab[i].dev, otab[i].ino);
+		*l = otab[i];
+	}
+
+	free(otab);
+}
+
+/* the directory fd is in, held open until its links are all made */
+static struct ldir *
+ldirget(struct links *ls, int fd)
+{
+	struct ldir *d, *spare;
+	struct stat st;
+	int i;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	for (spare = NULL, i = 0; i < LDIRMAX; i++) {
+		d = &ls->dirs[i];
+		if (!d->refs) {
+			if (!spare)
+				spare = d;
+		} else if (d->dev == st.st_dev && d->ino == st.st_ino) {
+			d->refs++;
+			return d;
+		}
+	}
+
+	if (!spare || (spare->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+		return NULL;
+
+	spare->dev  = st.st_dev;
+	spare->ino  = st.st_ino;
+	spare->refs = 1;
+
+	return spare;
+}
+
+static void
+ldirput(struct ldir *d)
+{
+	if (!--d->refs)
+		close(d->fd);
+}
+
+/*
+ * 0 when the file was linked to the copy of an earlier link, 1 when it is
+ * the first one and must be copied and marked, -1 to copy it on its own.
+ * the link is made relative to the directory of the first copy, which
+ * only falls back to its full path when too many are open.
+ */
 static int
-afile(const char *src, const char *dest, int opts, int depth, struct stat *st)
+linkto(struct links *ls, struct copy *cp)
+{
+	struct link *l;
+	const char *name;
+	int fd, rval, state;
+
+	pthread_mutex_lock(&ls->lock);
+
+	if ((ls->len + 1) * 2 > ls->cap)
+		linkgrow(ls);
+
+	l = linkslot(ls, cp->st->st_dev, cp->st->st_ino);
+	if (!l->path) {
+		l->dev   = cp->st->st_dev;
+		l->ino   = cp->st->st_ino;
+		l->path  = estrdup(cp->dest);
+		l->name  = estrdup(cp->tname);
+		l->dir   = ldirget(ls, cp->tfd);
+		l->left  = cp->st->st_nlink - 1;
+		l->state = LPENDING;
+		ls->len++;
+		pthread_mutex_unlock(&ls->lock);
+		return 1;
+	}
+
+	/* the table may move while waiting */
+	while ((state = l->state) == LPENDING) {
+		pthread_cond_wait(&ls->cond, &ls->lock);
+		l = linkslot(ls, cp->st->st_dev, cp->st->st_ino);
+	}
+	fd   = l->dir ? l->dir->fd : AT_FDCWD;
+	name = l->dir ? l->name : l->path;
+	pthread_mutex_unlock(&ls->lock);
+
+	rval = -1;
+	if (state == LDONE && linkat(fd, name, cp->tfd, cp->tname, 0) == 0)
+		rval = 0;
+
+	/* the last link seen lets the directory go */
+	pthread_mutex_lock(&ls->lock);
+	l = linkslot(ls, cp->st->st_dev, cp->st->st_ino);
+	if (l->left && !--l->left && l->dir) {
+		ldirput(l->dir);
+		l->dir = NULL;
+	}
+	pthread_mutex_unlock(&ls->lock);
+
+	return rval;
+}
+
+static void
+linkdone(struct links *ls, struct copy *cp, int state)
+{
+	pthread_mutex_lock(&ls->lock);
+	linkslot(ls, cp->st->st_dev, cp->st->st_ino)->state = state;
+	pthread_cond_broadcast(&ls->cond);
+	pthread_mutex_unlock(&ls->lock);
+}
+
+/* the source directory st was copied to a new one */
+static void
+dirmade(struct links *ls, struct stat *st)
+{
+	struct link *l;
+
+	pthread_mutex_lock(&ls->lock);
+	if ((ls->len + 1) * 2 > ls->cap)
+		linkgrow(ls);
+	l = linkslot(ls, st->st_dev, st->st_ino);
+	if (!l->path) {
+		l->dev   = st->st_dev;
+		l->ino   = st->st_ino;
+		l->path  = estrdup("");
+		l->state = LDONE;
+		ls->len++;
+	}
+	pthread_mutex_unlock(&ls->lock);
+}
+
+static int
+wasmade(struct links *ls, struct stat *st)
 {
-	struct copy cp;
 	int rval;
 
-	cp.src  = src;
-	cp.dest = dest;
-	cp.opts = opts;
-	cp.st   = st;
+	pthread_mutex_lock(&ls->lock);
+	rval = ls->cap && linkslot(ls, st->st_dev, st->st_ino)->path;
+	pthread_mutex_unlock(&ls->lock);
 
-	if (CP_FFLAG & opts)
-		unlink(dest);
+	return rval;
+}
 
+static int
+digest(int fd, const char *name, const char *path, uint8_t *buf)
+{
+	struct crypto p;
+	union hash_state md;
+	int rval;
+
+	if ((fd = openat(fd, name, O_RDONLY|O_CLOEXEC)) < 0)
+		return -1;
+
+	crypto_byname(&p, "sha256");
+	p.md  = &md;
+	p.buf = buf;
+	rval  = crypto_sum(&p, fd, path) ? -1 : 0;
+	close(fd);
+
+	return rval;
+}
+
+/* an earlier copy sets the mtime only once all the data is in */
+static int
+uptodate(struct copy *cp)
+{
+	struct stat st;
+	uint8_t s1[32], s2[32];
+
+	if (fstatat(cp->tfd, cp->tname, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+	    !S_ISREG(st.st_mode) || !S_ISREG(cp->st->st_mode))
+		return 0;
+
+	if ((CP_NEWER & cp->opts) &&
+	    (st.st_mtim.tv_sec > cp->st->st_mtim.tv_sec ||
+	    (st.st_mtim.tv_sec == cp->st->st_mtim.tv_sec &&
+	    st.st_mtim.tv_nsec > cp->st->st_mtim.tv_nsec)))
+		return 1;
+
+	if (st.st_size != cp->st->st_size)
+		return 0;
+
+	if (CP_SUM & cp->opts)
+		return !digest(cp->sfd, cp->sname, cp->src, s1) &&
+		       !digest(cp->tfd, cp->tname, cp->dest, s2) &&
+		       !memcmp(s1, s2, sizeof(s1));
+
+	return st.st_mtim.tv_sec  == cp->st->st_mtim.tv_sec &&
+	       st.st_mtim.tv_nsec == cp->st->st_mtim.tv_nsec;
+}
+
+static int
+afile(struct copy *cp)
+{
+	int own, rval;
+
+	if ((CP_UPDATE & cp->opts) && uptodate(cp))
+		return 0;
+
+	if ((CP_FFLAG|CP_UPDATE) & cp->opts)
+		unlinkat(cp->tfd, cp->tname, 0);
+
+	own  = 0;
 	rval = 0;
 
-	switch ((cp.st->st_mode & S_IFMT)) {
+	/* the other links of a file become links to its first copy */
+	if (cp->links && cp->st->st_nlink > 1 && !S_ISDIR(cp->st->st_mode) &&
+	    !(own = linkto(cp->links, cp)))
+		return 0;
+
+	switch ((cp->st->st_mode & S_IFMT)) {
 	case S_IFDIR:
 		errno = EISDIR;
-		warn("cpfile %s", src);
+		warn("cpfile %s", cp->src);
 		return 1;
 	case S_IFLNK:
-		rval = copy_lnk(&cp);
+		rval = copy_lnk(cp);
 		break;
 	case S_IFREG:
-		rval = copy_reg(&cp);
+		rval = copy_reg(cp);
 		break;
 	default:
-		rval = copy_spc(&cp);
+		rval = copy_spc(cp);
 		break;
 	}
 
+	if (own > 0)
+		linkdone(cp->links, cp, rval ? LFAILED : LDONE);
+
 	return rval;
 }
 
-/* external functions */
-int
-cpfile(const char *src, const char *dest, int opts, int depth)
+static void *
+worker(void *arg)
 {
-	struct stat st;
+	struct copy cp;
+	struct job j;
+	struct pool *pl;
+	int rval;
 
-	if ((FS_FOLLOW(depth) ? stat : lstat)(src, &st) < 0) {
-		warn("lstat %s", src);
+	pl = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&pl->lock);
+		while (!pl->len && !pl->done)
+			pthread_cond_wait(&pl->more, &pl->lock);
+		if (!pl->len) {
+			pthread_mutex_unlock(&pl->lock);
+			return NULL;
+		}
+		j = pl->q[pl->head];
+		pl->head = (pl->head + 1) % pl->cap;
+		pl->len--;
+		pthread_cond_signal(&pl->room);
+		pthread_mutex_unlock(&pl->lock);
+
+		cp.links = pl->links;
+		cp.src   = j.src;
+		cp.dest  = j.dest;
+		cp.sname = j.src + j.off;
+		cp.tname = j.src + j.off;
+		cp.sfd   = j.sfd;
+		cp.tfd   = j.tfd;
+		cp.opts  = pl->opts;
+		cp.st    = &j.st;
+		rval = afile(&cp);
+
+		free(j.src);
+		free(j.dest);
+
+		pthread_mutex_lock(&pl->lock);
+		pl->slots[j.sfd].rval |= rval;
+		if (!--pl->slots[j.sfd].busy)
+			pthread_cond_broadcast(&pl->idle);
+		pthread_mutex_unlock(&pl->lock);
+	}
+}
+
+static struct pool *
+poolnew(int nthreads, int opts, struct links *links)
+{
+	struct pool *pl;
+	int i;
+
+	pl = emalloc(sizeof(*pl));
+	memset(pl, 0, sizeof(*pl));
+	pl->nthreads = nthreads;
+	pl->opts     = opts;
+	pl->links    = links;
+	pl->cap      = 4 * nthreads;
+	pl->q        = emalloc(pl->cap * sizeof(*pl->q));
+	pl->tid      = emalloc(nthreads * sizeof(*pl->tid));
+	pthread_mutex_init(&pl->lock, NULL);
+	pthread_cond_init(&pl->more, NULL);
+	pthread_cond_init(&pl->room, NULL);
+	pthread_cond_init(&pl->idle, NULL);
+
+	for (i = 0; i < nthreads; i++)
+		if ((errno = pthread_create(&pl->tid[i], NULL, worker, pl)))
+			err(1, "pthread_create");
+
+	return pl;
+}
+
+static void
+poolfree(struct pool *pl)
+{
+	int i;
+
+	pthread_mutex_lock(&pl->lock);
+	pl->done = 1;
+	pthread_cond_broadcast(&pl->more);
+	pthread_mutex_unlock(&pl->lock);
+
+	for (i = 0; i < pl->nthreads; i++)
+		pthread_join(pl->tid[i], NULL);
+
+	pthread_cond_destroy(&pl->idle);
+	pthread_cond_destroy(&pl->room);
+	pthread_cond_destroy(&pl->more);
+	pthread_mutex_destroy(&pl->lock);
+	free(pl->slots);
+	free(pl->tid);
+	free(pl->q);
+	free(pl);
+}
+
+/* the queue is bounded, a full one holds the walk back */
+static void
+submit(struct pool *pl, FS_DIR *dir, int tfd, char *dest)
+{
+	struct job *j;
+	char *src;
+	int len;
+
+	src = estrdup(dir->path);
+
+	pthread_mutex_lock(&pl->lock);
+	while (pl->len == pl->cap)
+		pthread_cond_wait(&pl->room, &pl->lock);
+
+	if (dir->fd >= pl->nslots) {
+		len = dir->fd + 64;
+		if (!(pl->slots = realloc(pl->slots, len * sizeof(*pl->slots))))
+			err(1, "realloc");
+		memset(pl->slots + pl->nslots, 0,
+		       (len - pl->nslots) * sizeof(*pl->slots));
+		pl->nslots = len;
+	}
+	pl->slots[dir->fd].busy++;
+
+	j = &pl->q[(pl->head + pl->len++) % pl->cap];
+	j->st   = dir->info;
+	j->src  = src;
+	j->dest = dest;
+	j->off  = dir->plen;
+	j->sfd  = dir->fd;
+	j->tfd  = tfd;
+
+	pthread_cond_signal(&pl->more);
+	pthread_mutex_unlock(&pl->lock);
+}
+
+static int
+pre(FS_NODE *n)
+{
+	struct target *t;
+
+	t = n->data;
+	if (!n->parent) {
+		if (mkdir(t->path, S_IRWXU) == 0) {
+			dirmade(&t->made, &n->info);
+		} else if (errno != EEXIST) {
+			warn("mkdir %s", t->path);
+			return FS_ERR;
+		}
+		if (fs_jobs > 1)
+			t->pool = poolnew(fs_jobs, t->opts, &t->links);
+	}
+
+	return FS_OK;
+}
+
+static int
+visit(FS_NODE *n, FS_DIR *dir)
+{
+	struct copy cp;
+	struct target *t;
+	size_t len;
+	char *dest;
+	int rval;
+
+	if (ISDOT(dir->name))
+		return FS_OK;
+
+	/* the source path below the root, appended to the target */
+	t    = n->data;
+	len  = strlen(t->path) + strlen(dir->path + t->slen) + 1;
+	dest = emalloc(len);
+	snprintf(dest, len, "%s%s", t->path, dir->path + t->slen);
+
+	if ((CP_MOVE & t->opts) && !S_ISDIR(dir->info.st_mode)) {
+		t->mvbytes += dir->info.st_size;
+		t->mvfiles++;
+	}
+
+	if (S_ISDIR(dir->info.st_mode)) {
+		rval = FS_EXEC;
+		/* writable until post has seen it filled */
+		if (mkdirat(n->tfd, dir->name, S_IRWXU) == 0) {
+			dirmade(&t->made, &dir->info);
+		} else if (errno != EEXIST) {
+			warn("mkdir %s", dest);
+			n->rval = 1;
+			rval = FS_OK;
+		}
+		free(dest);
+		return rval;
+	}
+
+	/* the descriptors stay open until scan has seen every job done */
+	if (t->pool) {
+		submit(t->pool, dir, n->tfd, dest);
+		return FS_OK;
+	}
+
+	cp.links = &t->links;
+	cp.src   = dir->path;
+	cp.dest  = dest;
+	cp.sname = dir->name;
+	cp.tname = dir->name;
+	cp.sfd   = dir->fd;
+	cp.tfd   = n->tfd;
+	cp.opts  = t->opts;
+	cp.st    = &dir->info;
+	n->rval |= afile(&cp);
+
+	free(dest);
+
+	return FS_OK;
+}
+
+static void
+scan(FS_NODE *n)
+{
+	struct pool *pl;
+	struct slot *s;
+
+	if (!(pl = ((struct target *)n->data)->pool))
+		return;
+
+	pthread_mutex_lock(&pl->lock);
+	if (n->dir->fd < pl->nslots) {
+		s = &pl->slots[n->dir->fd];
+		while (s->busy)
+			pthread_cond_wait(&pl->idle, &pl->lock);
+		n->rval |= s->rval;
+		s->rval  = 0;
+	}
+	pthread_mutex_unlock(&pl->lock);
+}
+
+/* the copy of src is durable: remove what in src matches its copy */
+static int
+purge(const char *src, const char *dest)
+{
+	struct dirent *d;
+	struct stat ss, ts;
+	DIR *dp;
+	int sfd, tfd, rval;
+
+	if ((sfd = open(src, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		warn("open %s", src);
+		return 1;
+	}
+	if ((tfd = open(dest, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+		warn("open %s", dest);
+		close(sfd);
 		return 1;
 	}
+	if (!(dp = fdopendir(sfd))) {
+		warn("fdopendir %s", src);
+		close(sfd);
+		close(tfd);
+		return 1;
+	}
+
+	/*
+	 * subdirectories went before their parent. entries made or changed
+	 * since they were copied do not match and stay.
+	 */
+	while ((d = readdir(dp))) {
+		if (ISDOT(d->d_name) ||
+		    fstatat(sfd, d->d_name, &ss, AT_SYMLINK_NOFOLLOW) < 0 ||
+		    S_ISDIR(ss.st_mode) ||
+		    fstatat(tfd, d->d_name, &ts, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+		if ((ss.st_mode & S_IFMT) != (ts.st_mode & S_IFMT) ||
+		    ss.st_size != ts.st_size ||
+		    (S_ISREG(ss.st_mode) &&
+		    (ss.st_mtim.tv_sec != ts.st_mtim.tv_sec ||
+		    ss.st_mtim.tv_nsec != ts.st_mtim.tv_nsec)))
+			continue;
+		if (unlinkat(sfd, d->d_name, 0) < 0)
+			warn("unlink %s/%s", src, d->d_name);
+	}
+	closedir(dp);
+	close(tfd);
+
+	rval = 0;
+	if (rmdir(src) < 0) {
+		if (errno == ENOTEMPTY || errno == EEXIST)
+			warnx("%s: changed during the move, left in place", src);
+		else
+			warn("rmdir %s", src);
+		rval = 1;
+	}
 
-	return afile(src, dest, opts, depth, &st);
+	return rval;
 }
 
-int
-cpdir(const char *src, const char *dest, int opts, int depth)
+/* flush the target once, then remove the sources it now holds */
+static int
+mvflush(struct target *t)
 {
-	FS_DIR dir;
-	int rd, rval;
-	char buf[PATH_MAX];
+	size_t i;
+	int fd, rval;
+
+	if (!t->mvlen)
+		return 0;
 
 	rval = 0;
+	if ((fd = open(t->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+		warn("open %s", t->path);
+		rval = 1;
+	} else {
+#ifdef __linux__
+		if (syncfs(fd) < 0) {
+			warn("syncfs %s", t->path);
+			rval = 1;
+		}
+#else
+		sync();
+#endif
+		close(fd);
+	}
 
-	switch (open_dir(&dir, src)) {
-	case FS_ERR:
-		if (errno != ENOTDIR) {
-			warn("open_dir %s", src);
-			return 1;
+	for (i = 0; i < t->mvlen; i++) {
+		if (!rval)
+			rval |= purge(t->mv[i].src, t->mv[i].dest);
+		free(t->mv[i].src);
+		free(t->mv[i].dest);
+	}
+	t->mvlen   = 0;
+	t->mvfiles = 0;
+	t->mvbytes = 0;
+
+	return rval;
+}
+
+/* n and everything below it are copied, n goes with the next flush */
+static int
+mvqueue(struct target *t, FS_NODE *n)
+{
+	struct mvdir *m;
+	size_t len;
+
+	if (t->mvlen == t->mvcap) {
+		t->mvcap = t->mvcap ? t->mvcap << 1 : 64;
+		if (!(t->mv = realloc(t->mv, t->mvcap * sizeof(*t->mv))))
+			err(1, "realloc");
+	}
+
+	m       = &t->mv[t->mvlen++];
+	m->src  = estrdup(n->path);
+	len     = strlen(t->path) + strlen(n->path + t->slen) + 1;
+	m->dest = emalloc(len);
+	snprintf(m->dest, len, "%s%s", t->path, n->path + t->slen);
+
+	if (t->mvbytes < MVBYTES && t->mvfiles < MVFILES)
+		return 0;
+
+	return mvflush(t);
+}
+
+/* the final metadata of the directory n */
+static int
+dirmeta(struct target *t, FS_NODE *n)
+{
+	struct timespec times[2];
+	const char *dest, *name;
+	int fd, rval;
+
+	rval = 0;
+
+	if (n->parent) {
+		fd   = n->parent->tfd;
+		name = n->name;
+		dest = n->path + t->slen;
+	} else {
+		fd   = AT_FDCWD;
+		name = t->path;
+		dest = "";
+	}
+
+	/* without -p only the directories made here lose their 0700 */
+	if (!(CP_PFLAG & t->opts)) {
+		if (wasmade(&t->made, &n->info) && fchmodat(fd, name,
+		    n->info.st_mode & 0777 & ~t->mask, 0) < 0) {
+			warn("fchmod %s%s", t->path, dest);
+			rval = 1;
 		}
-		rval = cpfile(src, dest, opts, depth);
-		/* fallthrough */
-	case FS_CONT:
 		return rval;
 	}
 
-	if (!depth)
-		mkdir(dest, 0777);
+	if (fchownat(fd, name, n->info.st_uid, n->info.st_gid, 0) < 0) {
+		warn("fchown %s%s", t->path, dest);
+		rval = 1;
+	}
 
-	depth++;
-	while ((rd = read_dir(&dir)) == FS_EXEC) {
-		if (ISDOT(dir.name))
-			continue;
+	if (fchmodat(fd, name, n->info.st_mode & 07777, 0) < 0) {
+		warn("fchmod %s%s", t->path, dest);
+		rval = 1;
+	}
+
+	times[0] = n->info.st_atim;
+	times[1] = n->info.st_mtim;
+	if (utimensat(fd, name, times, 0) < 0) {
+		warn("futimens %s%s", t->path, dest);
+		rval = 1;
+	}
 
-		snprintf(buf, sizeof(buf), "%s/%s", dest, dir.name);
+	return rval;
+}
+
+/* the children are in, the directory can take its final metadata */
+static int
+post(FS_NODE *n)
+{
+	struct target *t;
+	int rval;
+
+	t    = n->data;
+	rval = dirmeta(t, n);
+
+	if (CP_MOVE & t->opts)
+		rval |= mvqueue(t, n);
+
+	return rval;
+}
+
+/* external functions */
+int
+cpfile(const char *src, const char *dest, int opts, int depth)
+{
+	struct copy cp;
+	struct stat st;
 
-		if (S_ISDIR(dir.info.st_mode)) {
-			if (mkdir(buf, dir.info.st_mode) < 0
-			    && errno != EEXIST) {
-				warn("mkdir %s", buf);
-				return 1;
-			}
+	if (fs_stat(AT_FDCWD, src, &st, FS_FOLLOW(depth) ? 0 : AT_SYMLINK_NOFOLLOW,
+	    FS_STAT) < 0) {
+		warn("lstat %s", src);
+		return 1;
+	}
+
+	cp.links = NULL;
+	cp.src   = src;
+	cp.dest  = dest;
+	cp.sname = src;
+	cp.tname = dest;
+	cp.sfd   = AT_FDCWD;
+	cp.tfd   = AT_FDCWD;
+	cp.opts  = opts;
+	cp.st    = &st;
+
+	return afile(&cp);
+}
+
+int
+cpdir(const char *src, const char *dest, int opts, int depth)
+{
+	struct fs_walk w;
+	struct target t;
+	size_t i;
+	int rval;
+
+	memset(&t.links, 0, sizeof(t.links));
+	pthread_mutex_init(&t.links.lock, NULL);
+	pthread_cond_init(&t.links.cond, NULL);
+	memset(&t.made, 0, sizeof(t.made));
+	pthread_mutex_init(&t.made.lock, NULL);
+	pthread_cond_init(&t.made.cond, NULL);
+
+	t.mask = umask(0);
+	umask(t.mask);
+	t.pool = NULL;
+	t.mv   = NULL;
+	t.path = dest;
+	t.slen = strlen(src);
+	t.opts = opts;
+	t.mvlen = t.mvcap = t.mvfiles = 0;
+	t.mvbytes = 0;
+	if (t.slen && src[t.slen - 1] == '/')
+		t.slen--;
+
+	w = (struct fs_walk){
+		.pre    = pre,
+		.visit  = visit,
+		.scan   = scan,
+		.post   = post,
+		.data   = &t,
+		.mirror = dest,
+		.need   = FS_STAT,
+		.jobs   = 1, /* directories in order, -j sizes the copy pool */
+	};
 
-			rval |= cpdir(dir.path, buf, opts, depth);
+	if ((rval = walk(src, &w)) == FS_ERR) {
+		if (errno != ENOTDIR) {
+			warn("open_dir %s", src);
+			rval = 1;
 		} else {
-			rval |= afile(dir.path, buf, opts, depth, &dir.info);
+			rval = cpfile(src, dest, opts, depth);
 		}
+	} else {
+		rval |= mvflush(&t);
 	}
-	depth--;
+	free(t.mv);
 
-	close_dir(&dir);
+	if (t.pool)
+		poolfree(t.pool);
 
-	if (rd == FS_ERR) {
-		warn("read_dir %s", dir.path);
-		return 1;
+	for (i = 0; i < t.links.cap; i++) {
+		free(t.links.tab[i].path);
+		free(t.links.tab[i].name);
 	}
+	for (i = 0; i < LDIRMAX; i++)
+		if (t.links.dirs[i].refs)
+			close(t.links.dirs[i].fd);
+	free(t.links.tab);
+	pthread_cond_destroy(&t.links.cond);
+	pthread_mutex_destroy(&t.links.lock);
+
+	for (i = 0; i < t.made.cap; i++)
+		free(t.made.tab[i].path);
+	free(t.made.tab);
+	pthread_cond_destroy(&t.made.cond);
+	pthread_mutex_destroy(&t.made.lock);
 
 	return rval;
 }
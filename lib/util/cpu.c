@@ -0,0 +1,69 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crypto.h"
+
+#ifdef HAVE_X86
+#include <cpuid.h>
+#endif
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int have;
+
+static void
+probe(void)
+{
+#ifdef HAVE_X86
+	unsigned int a, b, c, d, xcr0;
+	int mask, ymm;
+	char *s;
+
+	ymm = 0;
+	if (__get_cpuid(1, &a, &b, &c, &d)) {
+		if (c & bit_SSSE3)
+			have |= CPU_SSSE3;
+		if (c & bit_SSE4_1)
+			have |= CPU_SSE41;
+		/* the kernel has to save the wide registers */
+		if (c & bit_OSXSAVE) {
+			__asm__("xgetbv" : "=a"(xcr0), "=d"(d) : "c"(0));
+			ymm = (xcr0 & 0x6) == 0x6;
+		}
+	}
+
+	if (__get_cpuid_max(0, NULL) >= 7) {
+		__cpuid_count(7, 0, a, b, c, d);
+		if (b & bit_SHA)
+			have |= CPU_SHA;
+		if ((b & bit_AVX2) && ymm)
+			have |= CPU_AVX2;
+		if (b & bit_BMI2)
+			have |= CPU_BMI2;
+	}
+
+	/*
+	 * $UTILCHEST_NOSIMD keeps to the portable code, or hides only the
+	 * features it names: sha or avx2
+	 */
+	if ((s = getenv("UTILCHEST_NOSIMD")) && *s) {
+		mask = 0;
+		if (strstr(s, "sha"))
+			mask |= CPU_SHA;
+		if (strstr(s, "avx2"))
+			mask |= CPU_AVX2;
+		have &= mask ? ~mask : 0;
+	}
+#endif
+}
+
+/* every feature in mask can be used */
+int
+cpu_has(int mask)
+{
+	pthread_once(&once, probe);
+
+	return (have & mask) == mask;
+}
@@ -1,13 +1,53 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "crypto.h"
 #include "util.h"
 
+#define BATCH   512         /* files hashed together */
+#define LANEBUF (64 * 1024) /* read from each file in the lanes at once */
+#define MAPMIN  (256 * 1024)       /* smaller files are cheaper to read */
+#define MAPWIN  (64 * 1024 * 1024) /* mapped at once */
+#define MAPSTEP (1024 * 1024)      /* hashed between checkpoints */
+
+struct lane {
+	union hash_state md;
+	struct sumjob *job;
+	uint8_t *buf;
+	size_t off;
+	size_t len;
+	int fd;
+};
+
+/* the files of one crypto_sumv, taken by every thread in turn */
+struct sumq {
+	struct crypto *p;
+	struct sumjob *jobs;
+	size_t n;
+	size_t next;
+};
+
+/* how far mapfeed got, kept outside of its frame for siglongjmp */
+struct mapstep {
+	union hash_state save;
+	size_t done;
+};
+
+static pthread_key_t buskey;
+static pthread_once_t busonce = PTHREAD_ONCE_INIT;
+
 static int
 hextodec(int ch)
 {
@@ -52,81 +92,519 @@ sumprint(uint8_t *b, size_t n, const char *f)
 	printf(" %s\n", f);
 }
 
+/* the engine called name, p->md and p->buf are left to the caller */
+int
+crypto_byname(struct crypto *p, const char *name)
+{
+	static const struct {
+		const char *name;
+		void (*init)(union hash_state *);
+		void (*process)(union hash_state *, uint8_t *, unsigned long);
+		void (*done)(union hash_state *, uint8_t *);
+		size_t bsiz;
+	} tab[] = {
+		{ "sha1",   sha1_init,   sha1_process,   sha1_done,   20 },
+		{ "sha224", sha224_init, sha256_process, sha224_done, 28 },
+		{ "sha256", sha256_init, sha256_process, sha256_done, 32 },
+		{ "sha512", sha512_init, sha512_process, sha512_done, 64 },
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(tab) / sizeof(tab[0]); i++) {
+		if (!strcmp(tab[i].name, name)) {
+			p->init    = tab[i].init;
+			p->process = tab[i].process;
+			p->done    = tab[i].done;
+			p->bsiz    = tab[i].bsiz;
+			p->lanes   = NULL;
+			p->jobs    = 1;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* a page of a mapping past the end of a file that shrank */
+static void
+onbus(int sig)
+{
+	sigjmp_buf *jb;
+
+	/* not ours: fault again and die the usual way */
+	if (!(jb = pthread_getspecific(buskey))) {
+		signal(sig, SIG_DFL);
+		return;
+	}
+
+	siglongjmp(*jb, 1);
+}
+
+static void
+bussetup(void)
+{
+	struct sigaction sa;
+
+	pthread_key_create(&buskey, NULL);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onbus;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, NULL);
+}
+
+/*
+ * hash len bytes of a mapping into md a step at a time. 1 if the file
+ * was cut short under it, md is then left as it was before the step
+ * that faulted and ms->done tells how much of the mapping went in
+ */
 static int
-sumgen(struct crypto *p, int fd, const char *f)
+mapfeed(struct crypto *p, union hash_state *md, uint8_t *m, size_t len,
+    struct mapstep *ms)
 {
+	sigjmp_buf jb;
+	size_t n;
+
+	if (sigsetjmp(jb, 1)) {
+		pthread_setspecific(buskey, NULL);
+		*md = ms->save;
+		return 1;
+	}
+	pthread_setspecific(buskey, &jb);
+
+	for (ms->done = 0; ms->done < len; ms->done += n) {
+		n        = MIN(len - ms->done, MAPSTEP);
+		ms->save = *md;
+		p->process(md, m + ms->done, n);
+	}
+
+	pthread_setspecific(buskey, NULL);
+
+	return 0;
+}
+
+/*
+ * hash what is left of fd into md. a big regular file is mapped a window
+ * at a time and handed to process as it is. read picks up whatever the
+ * mappings did not cover: pipes, a failed mmap, a file that grew or one
+ * that shrank under its mapping.
+ */
+static int
+feed(struct crypto *p, union hash_state *md, int fd, const char *f)
+{
+	struct mapstep ms;
+	struct stat st;
 	ssize_t n;
-	uint8_t buf[BUFSIZ];
+	off_t off;
+	size_t len, pg, skip;
+	uint8_t *buf;
+	void *m;
 
-	p->init(p->md);
+	/* O_DIRECT asked to stay out of the page cache, mappings go through it */
+	if (!(fcntl(fd, F_GETFL) & O_DIRECT) && fstat(fd, &st) == 0 &&
+	    S_ISREG(st.st_mode) && (off = lseek(fd, 0, SEEK_CUR)) >= 0 &&
+	    st.st_size - off >= MAPMIN) {
+		pthread_once(&busonce, bussetup);
+		pg = sysconf(_SC_PAGESIZE);
+		for (; off < st.st_size; off += len) {
+			skip = off % pg;
+			len  = MIN(st.st_size - off, MAPWIN);
+			if ((m = mmap(NULL, len + skip, PROT_READ, MAP_SHARED, fd,
+			    off - skip)) == MAP_FAILED)
+				break;
 
-	while ((n = read(fd, buf, sizeof(buf))) > 0)
-		p->process(p->md, buf, n);
+			madvise(m, len + skip, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+			madvise(m, len + skip, MADV_HUGEPAGE);
+#endif
+			if (mapfeed(p, md, (uint8_t *)m + skip, len, &ms)) {
+				munmap(m, len + skip);
+				off += ms.done;
+				break;
+			}
+			munmap(m, len + skip);
+		}
+		lseek(fd, off, SEEK_SET);
+	}
+
+	buf = (uint8_t *)iobuf();
+	len = iosize(fd);
+	ioadvise(fd);
+
+	while ((n = read(fd, buf, len)) > 0)
+		p->process(md, buf, n);
 
 	if (n < 0) {
 		warn("read %s", f);
 		return 1;
 	}
 
-	p->done(p->md, p->buf);
+	iodone(fd);
 
 	return 0;
 }
 
+/* digest what is left of fd into p->buf */
 int
-crypto_check(struct crypto *p, FILE *fp, const char *fname)
+crypto_sum(struct crypto *p, int fd, const char *f)
 {
-	ssize_t n;
-	int fd, rval;
-	char *file;
-	char buf[LINE_MAX];
+	p->init(p->md);
 
-	rval =  0;
+	if (feed(p, p->md, fd, f))
+		return 1;
 
-	while ((n = fgetline(buf, sizeof(buf), fp)) > 0) {
-		buf[n-1] = '\0';
+	p->done(p->md, p->buf);
 
-		if ((file = strchr(buf, ' ')))
-			while (*file == ' ')
-				*file++ = '\0';
+	return 0;
+}
 
-		if (!file || !(*file)) {
-			rval = 1;
-			continue;
-		}
+static void
+sumjob(struct crypto *p, struct sumjob *j)
+{
+	uint8_t *buf;
+	int fd;
+
+	if ((fd = j->fd) < 0 && (fd = open(j->name, O_RDONLY)) < 0) {
+		warn("open %s", j->name);
+		j->err = 1;
+		return;
+	}
+
+	buf    = p->buf;
+	p->buf = j->sum;
+	j->err = crypto_sum(p, fd, j->name);
+	p->buf = buf;
+
+	if (fd != j->fd)
+		close(fd);
+}
+
+static struct sumjob *
+take(struct sumq *q)
+{
+	size_t i;
+
+	/* open descriptors belong to the calling thread */
+	do
+		i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED);
+	while (i < q->n && q->jobs[i].fd >= 0);
 
-		if ((fd = open(file, O_RDONLY)) < 0) {
-			warn("open %s", file);
-			rval = 1;
+	return (i < q->n) ? &q->jobs[i] : NULL;
+}
+
+/* give l the next file that opens, 0 once they are all taken */
+static int
+lanefill(struct crypto *p, struct lane *l, struct sumq *q)
+{
+	struct sumjob *j;
+
+	while ((j = take(q))) {
+		if ((l->fd = j->fd) < 0 &&
+		    (l->fd = open(j->name, O_RDONLY)) < 0) {
+			warn("open %s", j->name);
+			j->err = 1;
 			continue;
 		}
+		ioadvise(l->fd);
 
-		if (sumgen(p, fd, file) < 0) {
-			rval = 1;
-			continue;
+		p->init(&l->md);
+		l->job = j;
+		l->off = 0;
+		l->len = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* finish the file of l from what is left, all of it when drain is set */
+static void
+lanedone(struct crypto *p, struct lane *l, int drain)
+{
+	p->process(&l->md, l->buf + l->off, l->len);
+
+	if (drain && feed(p, &l->md, l->fd, l->job->name))
+		l->job->err = 1;
+	else
+		p->done(&l->md, l->job->sum);
+
+	if (l->fd != l->job->fd)
+		close(l->fd);
+	l->job = NULL;
+}
+
+/* a whole block in l, 0 when its file ended instead */
+static int
+laneread(struct crypto *p, struct lane *l)
+{
+	ssize_t n;
+
+	if (l->len >= 64)
+		return 1;
+
+	memmove(l->buf, l->buf + l->off, l->len);
+	l->off = 0;
+
+	n = 0;
+	while (l->len < 64 &&
+	    (n = read(l->fd, l->buf + l->len, LANEBUF - l->len)) > 0)
+		l->len += n;
+
+	if (l->len >= 64)
+		return 1;
+
+	if (n < 0) {
+		warn("read %s", l->job->name);
+		l->job->err = 1;
+		if (l->fd != l->job->fd)
+			close(l->fd);
+		l->job = NULL;
+	} else {
+		lanedone(p, l, 0);
+	}
+
+	return 0;
+}
+
+/*
+ * hash the files of q until there are none left. with a lanes function
+ * MBLANES files go through it side by side, each lane taking the next
+ * file as one ends.
+ */
+static void
+sumrun(struct crypto *p, struct sumq *q)
+{
+	static const uint8_t zero[LANEBUF];
+	struct lane lanes[MBLANES], *l;
+	struct sumjob *j;
+	union hash_state spare, *md[MBLANES];
+	const uint8_t *in[MBLANES];
+	size_t blk, i, live;
+
+	if (!p->lanes) {
+		while ((j = take(q)))
+			sumjob(p, j);
+		return;
+	}
+
+	for (i = 0; i < MBLANES; i++) {
+		lanes[i].buf = emalloc(LANEBUF);
+		lanes[i].job = NULL;
+	}
+	p->init(&spare);
+
+	for (;;) {
+		blk  = LANEBUF / 64;
+		live = 0;
+		for (i = 0; i < MBLANES; i++) {
+			l = &lanes[i];
+			while ((l->job || lanefill(p, l, q)) &&
+			    !laneread(p, l))
+				;
+
+			/* idle lanes hash zeros into a state nobody reads */
+			if (!l->job) {
+				md[i] = &spare;
+				in[i] = zero;
+				continue;
+			}
+
+			md[i] = &l->md;
+			in[i] = l->buf + l->off;
+			blk   = MIN(blk, l->len / 64);
+			live++;
 		}
 
-		switch (sumcheck(buf, p->buf, p->bsiz)) {
-		case 0:
-			printf("%s: OK\n", file);
+		if (!live)
+			break;
+
+		/* the last file left is done faster on its own */
+		if (live == 1 && __atomic_load_n(&q->next, __ATOMIC_RELAXED) >=
+		    q->n) {
+			for (l = lanes; !l->job; l++)
+				;
+			lanedone(p, l, 1);
 			break;
-		case 1:
-			printf("%s: FAILED\n", file);
-			/* fallthrough */
-		default:
-			rval = 1;
 		}
 
-		close(fd);
+		p->lanes(md, in, blk);
+
+		for (i = 0; i < MBLANES; i++) {
+			if (lanes[i].job) {
+				lanes[i].off += 64 * blk;
+				lanes[i].len -= 64 * blk;
+			}
+		}
+	}
+
+	for (i = 0; i < MBLANES; i++)
+		free(lanes[i].buf);
+}
+
+static void *
+sumthread(void *arg)
+{
+	struct crypto p;
+	struct sumq *q;
+	union hash_state md;
+
+	q    = arg;
+	p    = *q->p;
+	p.md = &md;
+	sumrun(&p, q);
+
+	return NULL;
+}
+
+/* hash every job into its sum, on p->jobs threads. jobs given an open
+ * descriptor may share a stream, they are read here one after another */
+void
+crypto_sumv(struct crypto *p, struct sumjob *jobs, size_t n)
+{
+	struct sumq q;
+	pthread_t *tid;
+	size_t i, nt;
+
+	for (i = 0; i < n; i++)
+		jobs[i].err = 0;
+
+	q = (struct sumq){
+		.p    = p,
+		.jobs = jobs,
+		.n    = n,
+	};
+
+	nt = (p->jobs > 1) ? MIN((size_t)p->jobs, n) : 1;
+	if (nt < 2) {
+		for (i = 0; i < n; i++)
+			if (jobs[i].fd >= 0)
+				sumjob(p, &jobs[i]);
+		sumrun(p, &q);
+		return;
 	}
 
+	tid = emalloc(nt * sizeof(*tid));
+	for (i = 1; i < nt; i++)
+		if ((errno = pthread_create(&tid[i], NULL, sumthread, &q)))
+			err(1, "pthread_create");
+
+	for (i = 0; i < n; i++)
+		if (jobs[i].fd >= 0)
+			sumjob(p, &jobs[i]);
+	sumthread(&q);
+
+	for (i = 1; i < nt; i++)
+		pthread_join(tid[i], NULL);
+	free(tid);
+}
+
+int
+crypto_check(struct crypto *p, FILE *fp, const char *fname)
+{
+	struct arena a;
+	struct sumjob *jobs;
+	ssize_t n;
+	size_t i, len, line;
+	int rval;
+	char **want, *file;
+	char buf[LINE_MAX];
+
+	memset(&a, 0, sizeof(a));
+	jobs = emalloc(BATCH * sizeof(*jobs));
+	want = emalloc(BATCH * sizeof(*want));
+	line = 0;
+	rval = 0;
+
+	do {
+		for (len = 0; len < BATCH &&
+		    (n = fgetline(buf, sizeof(buf), fp)) > 0;) {
+			buf[n-1] = '\0';
+			line++;
+
+			if ((file = strchr(buf, ' ')))
+				while (*file == ' ')
+					*file++ = '\0';
+
+			if (!file || !(*file) || strlen(buf) != p->bsiz*2 ||
+			    strspn(buf, "0123456789abcdefABCDEF") != p->bsiz*2) {
+				warnx("%s:%zu: improperly formatted line",
+				    fname, line);
+				rval = 1;
+				continue;
+			}
+
+			want[len]       = arena_strdup(&a, buf);
+			jobs[len].name  = arena_strdup(&a, file);
+			jobs[len++].fd  = -1;
+		}
+
+		crypto_sumv(p, jobs, len);
+
+		for (i = 0; i < len; i++) {
+			if (jobs[i].err) {
+				rval = 1;
+				continue;
+			}
+
+			switch (sumcheck(want[i], jobs[i].sum, p->bsiz)) {
+			case 0:
+				printf("%s: OK\n", jobs[i].name);
+				break;
+			case 1:
+				printf("%s: FAILED\n", jobs[i].name);
+				/* fallthrough */
+			default:
+				rval = 1;
+			}
+		}
+
+		arena_reset(&a);
+	} while (len == BATCH);
+
+	free(jobs);
+	free(want);
+
 	return rval;
 }
 
+/* the sum of every file, in order. none or - is the standard input */
 int
-crypto_print(struct crypto *p, FILE *fp, const char *fname) {
-	if (sumgen(p, fileno(fp), fname))
-		return -1;
-	sumprint(p->buf, p->bsiz, fname);
-	return 0;
+crypto_print(struct crypto *p, char **files, int n)
+{
+	static char *dash[] = { "-" };
+	struct sumjob *jobs;
+	int i, len, rval;
+
+	if (!n) {
+		files = dash;
+		n     = 1;
+	}
+
+	jobs = emalloc(BATCH * sizeof(*jobs));
+	rval = 0;
+
+	for (; n > 0; n -= len, files += len) {
+		len = MIN(n, BATCH);
+		for (i = 0; i < len; i++) {
+			jobs[i].name = files[i];
+			jobs[i].fd   = -1;
+			if (ISDASH(files[i])) {
+				jobs[i].name = "<stdin>";
+				jobs[i].fd   = STDIN_FILENO;
+			}
+		}
+
+		crypto_sumv(p, jobs, len);
+
+		for (i = 0; i < len; i++) {
+			if (jobs[i].err)
+				rval = 1;
+			else
+				sumprint(jobs[i].sum, p->bsiz, jobs[i].name);
+		}
+	}
+
+	free(jobs);
+
+	return rval;
 }
@@ -3,88 +3,429 @@
 #include <err.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "util.h"
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifdef SYS_getdents64
+#define HAVE_GETDENTS
+
+struct dent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+#define BATCH   8192
+#define DBUFMIN (32 * 1024)
+#define DBUFDEF (1024 * 1024)       /* most a directory buffer grows to */
+#define DBUFCAP (64 * 1024 * 1024)  /* most $UTILCHEST_DIRBUF may ask */
+
+struct dent {
+	ino_t ino;
+	char *name;
+	size_t nlen;
+	int type;
+};
+
 int fs_follow = 'P';
-struct histnode *fs_hist;
+
+#ifdef HAVE_GETDENTS
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static size_t dirbuf = DBUFDEF;
+
+static void
+setup(void)
+{
+	char *s;
+
+	if ((s = getenv("UTILCHEST_DIRBUF"))) {
+		dirbuf = MIN(strtobase(s, 0, SSIZE_MAX, 10), DBUFCAP);
+		if (dirbuf < DBUFMIN)
+			dirbuf = DBUFMIN;
+	}
+}
+#endif
+
+static size_t
+histhash(dev_t dev, ino_t ino)
+{
+	uint64_t h;
+
+	h  = (uint64_t)ino * 0x9e3779b97f4a7c15ULL;
+	h ^= (uint64_t)dev + (h >> 29);
+
+	return (size_t)(h ^ (h >> 32));
+}
 
 static struct histnode *
-popnode(struct histnode **hp)
+histslot(struct fs_hist *hp, dev_t dev, ino_t ino)
+{
+	struct histnode *np;
+	size_t i;
+
+	i = histhash(dev, ino) & (hp->cap - 1);
+	for (;; i = (i + 1) & (hp->cap - 1)) {
+		np = &hp->tab[i];
+		if (!np->used || (np->dev == dev && np->ino == ino))
+			return np;
+	}
+}
+
+static void
+histgrow(struct fs_hist *hp)
 {
-	struct histnode *op;
+	struct histnode *np, *otab;
+	size_t i, ocap;
 
-	op  = *hp;
-	*hp = op->next;
+	otab = hp->tab;
+	ocap = hp->cap;
 
-	return op;
+	/* the old table goes back with the arena */
+	hp->cap = ocap ? ocap << 1 : 64;
+	hp->tab = arena_alloc(&hp->arena, hp->cap * sizeof(*hp->tab));
+	memset(hp->tab, 0, hp->cap * sizeof(*hp->tab));
+
+	for (i = 0; i < ocap; i++) {
+		if (!otab[i].used)
+			continue;
+		np  = histslot(hp, otab[i].dev, otab[i].ino);
+		*np = otab[i];
+	}
 }
 
-int
-open_dir(FS_DIR *dir, const char *path)
+/* returns 1 if the directory was already visited during this walk */
+static int
+histadd(struct fs_hist *hp, dev_t dev, ino_t ino)
+{
+	struct histnode *np;
+	int rval;
+
+	rval = 1;
+	pthread_mutex_lock(&hp->lock);
+
+	if ((hp->len + 1) * 2 > hp->cap)
+		histgrow(hp);
+
+	np = histslot(hp, dev, ino);
+	if (!np->used) {
+		np->used = 1;
+		np->dev  = dev;
+		np->ino  = ino;
+		hp->len++;
+		rval = 0;
+	}
+
+	pthread_mutex_unlock(&hp->lock);
+
+	return rval;
+}
+
+static void
+closefd(FS_DIR *dir)
+{
+	if (dir->dirp)
+		closedir(dir->dirp);
+	else
+		close(dir->fd);
+}
+
+static int
+opendirat(FS_DIR *dir, int fd, const char *name, const char *path)
 {
 	struct stat st;
-	struct histnode *hp;
 
 	dir->dir  = (char *)path;
 	dir->dlen = strlen(dir->dir);
+	dir->ents = NULL;
+	dir->ord  = NULL;
+	dir->pool = NULL;
+	dir->dirp = NULL;
+	dir->dbuf = NULL;
+	dir->ecap = dir->ncap  = 0;
+	dir->nent = dir->cur   = 0;
+	dir->dbcap = dir->dbpos = dir->dbend = 0;
 
-	if (!(dir->dirp = opendir(dir->dir)))
+	if ((dir->fd = openat(fd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
 		return FS_ERR;
 
-	if (fstat(dirfd(dir->dirp), &st) < 0) {
-		closedir(dir->dirp);
+#ifndef HAVE_GETDENTS
+	if (!(dir->dirp = fdopendir(dir->fd))) {
+		close(dir->fd);
 		return FS_ERR;
 	}
+#endif
 
-	for (hp = fs_hist; hp; hp = hp->next) {
-		if (st.st_dev == hp->dev && st.st_ino == hp->ino) {
-			closedir(dir->dirp);
-			return FS_CONT;
-		}
+	if (fstat(dir->fd, &st) < 0) {
+		closefd(dir);
+		return FS_ERR;
 	}
 
-	hp       = emalloc(sizeof(*hp));
-	hp->dev  = st.st_dev;
-	hp->ino  = st.st_ino;
-	hp->next = fs_hist;
-	fs_hist  = hp;
+	if (histadd(dir->hist, st.st_dev, st.st_ino)) {
+		closefd(dir);
+		return FS_CONT;
+	}
+
+	dir->dev  = st.st_dev;
+	dir->ino  = st.st_ino;
+
+	/* the prefix is written once, entries only append their name */
+	dir->pcap = dir->dlen + NAME_MAX + 2;
+	dir->path = emalloc(dir->pcap);
+	memcpy(dir->path, dir->dir, dir->dlen);
+	dir->plen = dir->dlen;
+	if (!dir->plen || dir->path[dir->plen - 1] != '/')
+		dir->path[dir->plen++] = '/';
 
 	return FS_OK;
 }
 
 int
-read_dir(FS_DIR *dir)
+open_dir(FS_DIR *dir, const char *path)
+{
+	int rval, serrno;
+
+	dir->depth = 0;
+	dir->hist  = emalloc(sizeof(*dir->hist));
+	memset(dir->hist, 0, sizeof(*dir->hist));
+	pthread_mutex_init(&dir->hist->lock, NULL);
+
+	if ((rval = opendirat(dir, AT_FDCWD, path, path)) != FS_OK) {
+		serrno = errno;
+		pthread_mutex_destroy(&dir->hist->lock);
+		arena_reset(&dir->hist->arena);
+		free(dir->hist);
+		errno = serrno;
+	}
+
+	return rval;
+}
+
+/* name is relative to fd, the history is shared with root */
+int
+open_dirat(FS_DIR *dir, FS_DIR *root, int fd, const char *name,
+           const char *path)
+{
+	dir->depth = root->depth + 1;
+	dir->hist  = root->hist;
+
+	return opendirat(dir, fd, name, path);
+}
+
+/*
+ * the next entry, 0 at the end of the directory or -1 if it cannot be
+ * read. small directories are read with a small buffer, it doubles up to
+ * dirbuf while the reads keep filling it. $UTILCHEST_DIRBUF sets dirbuf,
+ * 1MiB by default.
+ */
+static int
+nextent(FS_DIR *dir, struct dent *de)
 {
+#ifdef HAVE_GETDENTS
+	struct dent64 *d;
+	size_t len, min;
+	long n;
+
+	if (dir->dbpos == dir->dbend) {
+		if (!dir->dbuf)
+			pthread_once(&once, setup);
+		if (!dir->dbuf || (dir->dbend > dir->dbcap / 2 &&
+		    dir->dbcap < dirbuf)) {
+			dir->dbcap = dir->dbuf ?
+			    MIN(dir->dbcap << 1, dirbuf) : DBUFMIN;
+			free(dir->dbuf);
+			dir->dbuf = emalloc(dir->dbcap);
+		}
+
+		dir->dbpos = dir->dbend = 0;
+		if ((n = syscall(SYS_getdents64, dir->fd, dir->dbuf,
+		    dir->dbcap)) <= 0)
+			return n ? -1 : 0;
+		dir->dbend = n;
+	}
+
+	d = (struct dent64 *)(dir->dbuf + dir->dbpos);
+	dir->dbpos += d->d_reclen;
+
+	de->ino  = d->d_ino;
+	de->type = d->d_type;
+	de->name = d->d_name;
+
+	/* records are padded to 8 bytes, the terminator is in the last 8 */
+	len = d->d_reclen - offsetof(struct dent64, d_name);
+	min = (len > 8) ? len - 8 : 0;
+	de->nlen = (char *)memchr(de->name + min, 0, len - min) - de->name;
+#else
 	struct dirent *entry;
-	int (*statf)(const char *, struct stat *);
 
-	statf = FS_FOLLOW(1) ? stat : lstat;
+	errno = 0;
+	if (!(entry = readdir(dir->dirp)))
+		return errno ? -1 : 0;
+
+	de->ino  = entry->d_ino;
+	de->type = entry->d_type;
+	de->name = entry->d_name;
+	de->nlen = strlen(entry->d_name);
+#endif
+	return 1;
+}
+
+static void
+setname(FS_DIR *dir, char *name, size_t nlen)
+{
+	dir->name = name;
+	dir->nlen = nlen;
+
+	if (dir->plen + dir->nlen >= dir->pcap) {
+		dir->pcap = dir->plen + dir->nlen + NAME_MAX + 1;
+		if (!(dir->path = realloc(dir->path, dir->pcap)))
+			err(1, "realloc");
+	}
+	memcpy(dir->path + dir->plen, dir->name, dir->nlen + 1);
+}
+
+static int
+inocmp(const void *a, const void *b)
+{
+	ino_t i1, i2;
+
+	i1 = (*(struct fs_ent **)a)->ino;
+	i2 = (*(struct fs_ent **)b)->ino;
+
+	return (i1 > i2) - (i1 < i2);
+}
+
+/* read a batch of entries and stat them in inode order */
+static int
+fill(FS_DIR *dir, int need, int flags)
+{
+	struct dent de;
+	struct fs_ent *e;
+	size_t i, len;
+	int rd;
+
+	dir->nent = dir->cur = 0;
+	rd = 0;
+
+	for (len = 0; dir->nent < BATCH; len += e->nlen + 1) {
+		if ((rd = nextent(dir, &de)) <= 0)
+			break;
+
+		if (dir->nent == dir->ecap) {
+			dir->ecap = dir->ecap ? dir->ecap << 1 : 64;
+			if (!(dir->ents = realloc(dir->ents,
+			    dir->ecap * sizeof(*dir->ents))) ||
+			    !(dir->ord = realloc(dir->ord,
+			    dir->ecap * sizeof(*dir->ord))))
+				err(1, "realloc");
+		}
+
+		e = &dir->ents[dir->nent++];
+		e->ino  = de.ino;
+		e->nlen = de.nlen;
+		e->off  = len;
+
+		if (len + e->nlen + 1 > dir->ncap) {
+			dir->ncap = (len + e->nlen + 1) << 1;
+			if (!(dir->pool = realloc(dir->pool, dir->ncap)))
+				err(1, "realloc");
+		}
+		memcpy(dir->pool + len, de.name, e->nlen + 1);
+	}
+
+	/* what was read comes out first, the error again on the next fill */
+	if (!dir->nent) {
+		dir->path[dir->plen] = '\0';
+		return rd ? FS_ERR : FS_OK;
+	}
 
-	if ((entry = readdir(dir->dirp))) {
-		dir->name = entry->d_name;
-		dir->nlen = strlen(dir->name);
+	for (i = 0; i < dir->nent; i++)
+		dir->ord[i] = &dir->ents[i];
+	qsort(dir->ord, dir->nent, sizeof(*dir->ord), inocmp);
+
+	fs_statv(dir->fd, dir->ord, dir->pool, dir->nent, flags, need);
+
+	return FS_EXEC;
+}
+
+int
+read_dir(FS_DIR *dir, int need)
+{
+	struct dent de;
+	struct fs_ent *e;
+	int flags, rd;
 
-		snprintf(dir->path, sizeof(dir->path),
-		         "%s/%s", dir->dir, dir->name);
+	flags = FS_FOLLOW(1) ? 0 : AT_SYMLINK_NOFOLLOW;
 
-		if (statf(dir->path, &dir->info) < 0)
+	/* entries still come out in directory order */
+	if ((need & FS_INOSORT) && (need & FS_STAT)) {
+		if (dir->cur == dir->nent &&
+		    (rd = fill(dir, need, flags)) != FS_EXEC)
+			return rd;
+
+		e = &dir->ents[dir->cur++];
+		setname(dir, dir->pool + e->off, e->nlen);
+
+		if (e->err) {
+			errno = e->err;
 			return FS_ERR;
-	} else {
-		return FS_OK;
+		}
+
+		dir->info = e->info;
+		return FS_EXEC;
 	}
 
+	if ((rd = nextent(dir, &de)) <= 0) {
+		dir->path[dir->plen] = '\0';
+		return rd ? FS_ERR : FS_OK;
+	}
+
+	setname(dir, de.name, de.nlen);
+
+	/* d_type and d_ino are enough unless the entry must be followed */
+	if (!(need & FS_STAT & ~FS_INO) && de.type != DT_UNKNOWN &&
+	    !(de.type == DT_LNK && flags != AT_SYMLINK_NOFOLLOW)) {
+		memset(&dir->info, 0, sizeof(dir->info));
+		dir->info.st_mode = DTTOIF(de.type);
+		dir->info.st_ino  = de.ino;
+		return FS_EXEC;
+	}
+
+	if (fs_stat(dir->fd, dir->name, &dir->info, flags, need) < 0)
+		return FS_ERR;
+
 	return FS_EXEC;
 }
 
 void
 close_dir(FS_DIR *dir)
 {
-	closedir(dir->dirp);
-	while (fs_hist)
-		free(popnode(&fs_hist));
+	closefd(dir);
+	free(dir->dbuf);
+	free(dir->path);
+	free(dir->ents);
+	free(dir->ord);
+	free(dir->pool);
+
+	/* the history lives as long as the walk */
+	if (!dir->depth) {
+		pthread_mutex_destroy(&dir->hist->lock);
+		arena_reset(&dir->hist->arena);
+		free(dir->hist);
+	}
 }
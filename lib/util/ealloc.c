@@ -4,6 +4,15 @@
 
 #include "util.h"
 
+#define ARENAMIN 4096
+#define ARENAMAX (1 << 20)
+
+/* the header keeps the data 16 bytes aligned */
+struct chunk {
+	struct chunk *next;
+	size_t pad;
+};
+
 void *
 emalloc(size_t size)
 {
@@ -25,3 +34,54 @@ estrdup(const char *s)
 
 	return p;
 }
+
+/* arena: allocations are only released all at once */
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct chunk *c;
+	size_t len;
+	void *p;
+
+	size = (size + 15) & ~(size_t)15;
+
+	if (size > a->left) {
+		a->size = a->size ? MIN(a->size << 1, ARENAMAX) : ARENAMIN;
+		len = (size > a->size) ? size : a->size;
+
+		c = emalloc(sizeof(*c) + len);
+		c->next   = a->chunks;
+		a->chunks = c;
+		a->p      = (char *)(c + 1);
+		a->left   = len;
+	}
+
+	p = a->p;
+	a->p    += size;
+	a->left -= size;
+
+	return p;
+}
+
+char *
+arena_strdup(struct arena *a, const char *s)
+{
+	size_t len;
+
+	len = strlen(s) + 1;
+
+	return memcpy(arena_alloc(a, len), s, len);
+}
+
+void
+arena_reset(struct arena *a)
+{
+	struct chunk *c, *next;
+
+	for (c = a->chunks; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+
+	memset(a, 0, sizeof(*a));
+}
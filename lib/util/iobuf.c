@@ -0,0 +1,106 @@
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define IOMIN  (128 * 1024)
+#define IOMAX  (1024 * 1024)
+#define IOCAP  (64 * 1024 * 1024)  /* most $UTILCHEST_IOSIZE may ask */
+#define IODROP (64L * 1024 * 1024) /* bigger files leave the cache */
+
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static size_t iofixed; /* $UTILCHEST_IOSIZE */
+static size_t iolen;   /* of every buffer */
+
+static void
+setup(void)
+{
+	char *s;
+
+	pthread_key_create(&key, free);
+
+	/* whole sectors, so the buffer also serves O_DIRECT reads */
+	if ((s = getenv("UTILCHEST_IOSIZE"))) {
+		iofixed = MIN(strtobase(s, 0, SSIZE_MAX, 10), IOCAP) / 512 * 512;
+		if (!iofixed)
+			iofixed = 512;
+	}
+
+	iolen = iofixed ? iofixed : IOMAX;
+}
+
+/* fd is about to be read through once, it can be read ahead */
+void
+ioadvise(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+}
+
+/*
+ * how much to read from fd at once: blocks of the file up to its size
+ * within IOMIN and IOMAX
+ */
+size_t
+iosize(int fd)
+{
+	struct stat st;
+	size_t blk, len;
+
+	pthread_once(&once, setup);
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return iofixed ? iofixed : IOMIN;
+
+	if (iofixed)
+		return iofixed;
+
+	blk = (st.st_blksize > 0) ? st.st_blksize : 4096;
+	len = ((size_t)st.st_size + blk - 1) / blk * blk;
+
+	if (len < IOMIN)
+		len = IOMIN;
+	if (len > IOMAX)
+		len = IOMAX / blk * blk;
+
+	return len ? len : IOMAX;
+}
+
+/* page aligned and made once per thread, big enough for any iosize */
+char *
+iobuf(void)
+{
+	void *p;
+
+	pthread_once(&once, setup);
+
+	if (!(p = pthread_getspecific(key))) {
+		if ((errno = posix_memalign(&p, sysconf(_SC_PAGESIZE), iolen)))
+			err(1, "posix_memalign");
+		pthread_setspecific(key, p);
+	}
+
+	return p;
+}
+
+/* fd was read through, a big file should not push the cache out */
+void
+iodone(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > IODROP)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
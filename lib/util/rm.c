@@ -0,0 +1,143 @@
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define BATCH 256
+
+/* files of a directory are unlinked a batch at a time */
+struct batch {
+	char *names[BATCH];
+	char pool[BATCH * (NAME_MAX + 1)];
+	int errs[BATCH];
+	size_t len;
+	int n;
+};
+
+static int
+afile(int fd, const char *name, const char *f, struct stat *st)
+{
+	if (unlinkat(fd, name, S_ISDIR(st->st_mode) ? AT_REMOVEDIR : 0) < 0) {
+		warn("delfile %s", f);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+flush(FS_NODE *n)
+{
+	struct batch *b;
+	int i;
+
+	b = n->data;
+	fs_unlinkv(n->dir->fd, b->names, b->errs, b->n);
+
+	for (i = 0; i < b->n; i++) {
+		if (!b->errs[i])
+			continue;
+		errno = b->errs[i];
+		warn("delfile %.*s%s", (int)n->dir->plen, n->dir->path,
+		     b->names[i]);
+		n->rval = 1;
+	}
+
+	b->len = 0;
+	b->n   = 0;
+}
+
+static int
+pre(FS_NODE *n)
+{
+	struct batch *b;
+
+	b = emalloc(sizeof(*b));
+	b->len = 0;
+	b->n   = 0;
+	n->data = b;
+
+	return FS_OK;
+}
+
+static int
+visit(FS_NODE *n, FS_DIR *dir)
+{
+	struct batch *b;
+
+	if (ISDOT(dir->name))
+		return FS_OK;
+
+	if (S_ISDIR(dir->info.st_mode))
+		return FS_EXEC;
+
+	b = n->data;
+	if (b->n == BATCH)
+		flush(n);
+
+	b->names[b->n++] = memcpy(b->pool + b->len, dir->name, dir->nlen + 1);
+	b->len += dir->nlen + 1;
+
+	return FS_OK;
+}
+
+static void
+scan(FS_NODE *n)
+{
+	flush(n);
+	free(n->data);
+}
+
+static int
+post(FS_NODE *n)
+{
+	return afile(n->at, n->name, n->path, &n->info);
+}
+
+/* external functions */
+int
+delfile(const char *f, int fflag)
+{
+	struct stat st;
+
+	if (fs_stat(AT_FDCWD, f, &st, AT_SYMLINK_NOFOLLOW, FS_TYPE) < 0) {
+		if (!fflag && errno != ENOENT)
+			warn("lstat %s", f);
+		return (!fflag);
+	}
+
+	return afile(AT_FDCWD, f, f, &st);
+}
+
+int
+deldir(const char *f, int fflag)
+{
+	struct fs_walk w;
+	int rval;
+
+	w = (struct fs_walk){
+		.pre   = pre,
+		.visit = visit,
+		.scan  = scan,
+		.post  = post,
+		.need  = FS_TYPE,
+	};
+
+	if ((rval = walk(f, &w)) == FS_ERR) {
+		if (errno != ENOTDIR) {
+			warn("open_dir %s", f);
+			return 1;
+		}
+		rval = delfile(f, fflag);
+	}
+
+	return rval;
+}
@@ -1,10 +1,15 @@
 /* implementation based on libtomcrypt */
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "util.h"
 #include "crypto.h"
 
+#ifdef HAVE_X86
+#include <immintrin.h>
+#endif
+
 #define REV(a,b,c,d,e,t) t=e;e=d;d=c;c=b;b=a;a=t
 #define F0(a,b,c) (c ^ (a & (b ^ c)))
 #define F1(a,b,c) (a ^ b ^ c)
@@ -15,6 +20,9 @@
 #define FF2(a,b,c,d,e,i) e = (rol(a, 5) + F2(b,c,d) + e + W[i] + 0x8f1bbcdcUL); b = rol(b, 30);
 #define FF3(a,b,c,d,e,i) e = (rol(a, 5) + F3(b,c,d) + e + W[i] + 0xca62c1d6UL); b = rol(b, 30);
 
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static void (*compress)(uint32_t *, const uint8_t *, size_t);
+
 static uint32_t
 rol(uint32_t n, int k)
 {
@@ -22,53 +30,151 @@ rol(uint32_t n, int k)
 }
 
 static void
-sha1_compress(union hash_state *md, uint8_t *buf)
+sha1_compress(uint32_t *s, const uint8_t *buf, size_t n)
 {
 	uint32_t W[80], a, b, c, d, e, t;
 	int i;
 
-	for (i = 0; i < 16; i++)
-		LOAD32H(W[i], buf + (4 * i));
+	for (; n; n--, buf += 64) {
+		for (i = 0; i < 16; i++)
+			LOAD32H(W[i], buf + (4 * i));
 
-	for (i = 16; i < 80; i++)
-		W[i] = rol(W[i - 3] ^ W[i - 8] ^ W[i - 14] ^ W[i - 16], 1);
+		for (i = 16; i < 80; i++)
+			W[i] = rol(W[i - 3] ^ W[i - 8] ^ W[i - 14] ^ W[i - 16], 1);
 
-	a = md->sha1.state[0];
-	b = md->sha1.state[1];
-	c = md->sha1.state[2];
-	d = md->sha1.state[3];
-	e = md->sha1.state[4];
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		e = s[4];
 
-	for (i = 0; i < 20; i++) {
-		FF0(a,b,c,d,e,i);
-		REV(a,b,c,d,e,t);
-	}
+		for (i = 0; i < 20; i++) {
+			FF0(a,b,c,d,e,i);
+			REV(a,b,c,d,e,t);
+		}
 
-	for (; i < 40; i++) {
-		FF1(a,b,c,d,e,i);
-		REV(a,b,c,d,e,t);
-	}
+		for (; i < 40; i++) {
+			FF1(a,b,c,d,e,i);
+			REV(a,b,c,d,e,t);
+		}
+
+		for (; i < 60; i++) {
+			FF2(a,b,c,d,e,i);
+			REV(a,b,c,d,e,t);
+		}
+
+		for (; i < 80; i++) {
+			FF3(a,b,c,d,e,i);
+			REV(a,b,c,d,e,t);
+		}
 
-	for (; i < 60; i++) {
-		FF2(a,b,c,d,e,i);
-		REV(a,b,c,d,e,t);
+		s[0] += a;
+		s[1] += b;
+		s[2] += c;
+		s[3] += d;
+		s[4] += e;
 	}
+}
 
-	for (; i < 80; i++) {
-		FF3(a,b,c,d,e,i);
-		REV(a,b,c,d,e,t);
+#ifdef HAVE_X86
+/*
+ * four rounds of function f on m0, which is ready, while the schedule
+ * moves on: m1 is finished and m3 started for the rounds to come
+ */
+#define QROUND(e0, e1, m0, m1, m2, m3, f) do { \
+	e0   = _mm_sha1nexte_epu32(e0, m0); \
+	e1   = abcd; \
+	m1   = _mm_sha1msg2_epu32(m1, m0); \
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, f); \
+	m3   = _mm_sha1msg1_epu32(m3, m0); \
+	m2   = _mm_xor_si128(m2, m0); \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha1_shani(uint32_t *s, const uint8_t *buf, size_t n)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+	                                    0x08090a0b0c0d0e0fULL);
+	__m128i abcd, e0, e1, m0, m1, m2, m3, save0, save1;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)s), 0x1B);
+	e0   = _mm_set_epi32(s[4], 0, 0, 0);
+
+	for (; n; n--, buf += 64) {
+		save0 = abcd;
+		save1 = e0;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buf), mask);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 16)),
+		                      mask);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 32)),
+		                      mask);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 48)),
+		                      mask);
+
+		/* the schedule fills up over the first rounds */
+		e0   = _mm_add_epi32(e0, m0);
+		e1   = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		e1   = _mm_sha1nexte_epu32(e1, m1);
+		e0   = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m0   = _mm_sha1msg1_epu32(m0, m1);
+
+		e0   = _mm_sha1nexte_epu32(e0, m2);
+		e1   = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1   = _mm_sha1msg1_epu32(m1, m2);
+		m0   = _mm_xor_si128(m0, m2);
+
+		QROUND(e1, e0, m3, m0, m1, m2, 0);
+		QROUND(e0, e1, m0, m1, m2, m3, 0);
+		QROUND(e1, e0, m1, m2, m3, m0, 1);
+		QROUND(e0, e1, m2, m3, m0, m1, 1);
+		QROUND(e1, e0, m3, m0, m1, m2, 1);
+		QROUND(e0, e1, m0, m1, m2, m3, 1);
+		QROUND(e1, e0, m1, m2, m3, m0, 1);
+		QROUND(e0, e1, m2, m3, m0, m1, 2);
+		QROUND(e1, e0, m3, m0, m1, m2, 2);
+		QROUND(e0, e1, m0, m1, m2, m3, 2);
+		QROUND(e1, e0, m1, m2, m3, m0, 2);
+		QROUND(e0, e1, m2, m3, m0, m1, 2);
+		QROUND(e1, e0, m3, m0, m1, m2, 3);
+		QROUND(e0, e1, m0, m1, m2, m3, 3);
+		QROUND(e1, e0, m1, m2, m3, m0, 3);
+		QROUND(e0, e1, m2, m3, m0, m1, 3);
+
+		/* the last rounds have no schedule left to feed */
+		e1   = _mm_sha1nexte_epu32(e1, m3);
+		e0   = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		e0   = _mm_sha1nexte_epu32(e0, save1);
+		abcd = _mm_add_epi32(abcd, save0);
 	}
 
-	md->sha1.state[0] += a;
-	md->sha1.state[1] += b;
-	md->sha1.state[2] += c;
-	md->sha1.state[3] += d;
-	md->sha1.state[4] += e;
+	_mm_storeu_si128((__m128i *)s, _mm_shuffle_epi32(abcd, 0x1B));
+	s[4] = _mm_extract_epi32(e0, 3);
+}
+#endif
+
+static void
+pick(void)
+{
+	compress = sha1_compress;
+#ifdef HAVE_X86
+	if (cpu_has(CPU_SHA|CPU_SSE41|CPU_SSSE3))
+		compress = sha1_shani;
+#endif
 }
 
 void
 sha1_init(union hash_state *md)
 {
+	pthread_once(&once, pick);
+
 	md->sha1.length   = 0;
 	md->sha1.state[0] = 0x67452301UL;
 	md->sha1.state[1] = 0xefcdab89UL;
@@ -92,10 +198,11 @@ sha1_process(union hash_state *md, uint8_t *in, unsigned long len)
 		memcpy(md->sha1.buf + r, in, 64 - r);
 		len -= 64 - r;
 		in  += 64 - r;
-		sha1_compress(md, md->sha1.buf);
+		compress(md->sha1.state, md->sha1.buf, 1);
 	}
-	for (; len >= 64; len -= 64, in += 64)
-		sha1_compress(md, in);
+	compress(md->sha1.state, in, len / 64);
+	in  += len & ~63UL;
+	len &= 63;
 	memcpy(md->sha1.buf, in, len);
 }
 
@@ -109,14 +216,14 @@ sha1_done(union hash_state *md, uint8_t *out)
 	md->sha1.buf[r++] = 0x80;
 	if (r > 56) {
 		memset(md->sha1.buf + r, 0, 64 - r);
-		sha1_compress(md, md->sha1.buf);
+		compress(md->sha1.state, md->sha1.buf, 1);
 		r = 0;
 	}
 
 	memset(md->sha1.buf + r, 0, 56 - r);
 	md->sha1.length *= 8;
 	STORE64H(md->sha1.length, md->sha1.buf + 56);
-	sha1_compress(md, md->sha1.buf);
+	compress(md->sha1.state, md->sha1.buf, 1);
 
 	for (i = 0; i < 5; i++)
 		STORE32H(md->sha1.state[i], out + (4 * i));
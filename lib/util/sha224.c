@@ -8,7 +8,7 @@
 void
 sha224_init(union hash_state *md)
 {
-	md->sha256.length   = 0;
+	sha256_init(md);
 	md->sha256.state[0] = 0xc1059ed8UL;
 	md->sha256.state[1] = 0x367cd507UL;
 	md->sha256.state[2] = 0x3070dd17UL;
@@ -1,10 +1,15 @@
 /* implementation based on libtomcrypt */
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "util.h"
 #include "crypto.h"
 
+#ifdef HAVE_X86
+#include <immintrin.h>
+#endif
+
 #define REV(a,b,c,d,e,f,g,h,t) t=h;h=g;g=f;f=e;e=d;d=c;c=b;b=a;a=t
 #define Ch(a,b,c)  (c ^ (a & (b ^ c)))
 #define Maj(a,b,c) ((a & b) | (c & (a | b)))
@@ -30,6 +35,9 @@ static const uint32_t K[64] = {
 	0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
 };
 
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static void (*compress)(uint32_t *, const uint8_t *, size_t);
+
 static uint32_t
 ror(uint32_t n, int k)
 {
@@ -37,47 +45,254 @@ ror(uint32_t n, int k)
 }
 
 static void
-sha256_compress(union hash_state *md, uint8_t *buf)
+sha256_compress(uint32_t *s, const uint8_t *buf, size_t n)
 {
 	uint32_t W[64], a, b, c, d, e, f, g, h, t, t0, t1;
 	int i;
 
-	for (i = 0; i < 16; i++)
-		LOAD32H(W[i], buf + (4 * i));
-
-	for (i = 16; i < 64; i++)
-		W[i] = G1(W[i - 2]) + W[i - 7] + G0(W[i - 15]) + W[i - 16];
-
-	a = md->sha256.state[0];
-	b = md->sha256.state[1];
-	c = md->sha256.state[2];
-	d = md->sha256.state[3];
-	e = md->sha256.state[4];
-	f = md->sha256.state[5];
-	g = md->sha256.state[6];
-	h = md->sha256.state[7];
-
-	for (i = 0; i < 64; i++) {
-		t0 = h + S1(e) + Ch(e, f, g) + K[i] + W[i];
-		t1 = S0(a) + Maj(a, b, c);
-		d += t0;
-		h  = t0 + t1;
-		REV(a, b, c, d, e, f, g, h, t);
+	for (; n; n--, buf += 64) {
+		for (i = 0; i < 16; i++)
+			LOAD32H(W[i], buf + (4 * i));
+
+		for (i = 16; i < 64; i++)
+			W[i] = G1(W[i - 2]) + W[i - 7] + G0(W[i - 15]) +
+			       W[i - 16];
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		e = s[4];
+		f = s[5];
+		g = s[6];
+		h = s[7];
+
+		for (i = 0; i < 64; i++) {
+			t0 = h + S1(e) + Ch(e, f, g) + K[i] + W[i];
+			t1 = S0(a) + Maj(a, b, c);
+			d += t0;
+			h  = t0 + t1;
+			REV(a, b, c, d, e, f, g, h, t);
+		}
+
+		s[0] += a;
+		s[1] += b;
+		s[2] += c;
+		s[3] += d;
+		s[4] += e;
+		s[5] += f;
+		s[6] += g;
+		s[7] += h;
+	}
+}
+
+#ifdef HAVE_X86
+/* four rounds on m, the words of the message schedule at K[i] */
+#define QROUND(m, i) do { \
+	t  = _mm_add_epi32((m), _mm_loadu_si128((const __m128i *)&K[i])); \
+	s1 = _mm_sha256rnds2_epu32(s1, s0, t); \
+	t  = _mm_shuffle_epi32(t, 0x0E); \
+	s0 = _mm_sha256rnds2_epu32(s0, s1, t); \
+} while (0)
+
+/* the next four words into a, from the sixteen in a, b, c and d */
+#define SCHED(a, b, c, d) \
+	(a) = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32((a), (b)), \
+	      _mm_alignr_epi8((d), (c), 4)), (d))
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_shani(uint32_t *s, const uint8_t *buf, size_t n)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	                                    0x0405060700010203ULL);
+	__m128i m0, m1, m2, m3, s0, s1, save0, save1, t;
+	int i;
+
+	/* the instructions want ABEF and CDGH */
+	t  = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&s[0]), 0xB1);
+	s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&s[4]), 0x1B);
+	s0 = _mm_alignr_epi8(t, s1, 8);
+	s1 = _mm_blend_epi16(s1, t, 0xF0);
+
+	for (; n; n--, buf += 64) {
+		save0 = s0;
+		save1 = s1;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buf), mask);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 16)),
+		                      mask);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 32)),
+		                      mask);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 48)),
+		                      mask);
+
+		QROUND(m0, 0);
+		QROUND(m1, 4);
+		QROUND(m2, 8);
+		QROUND(m3, 12);
+
+		for (i = 16; i < 64; i += 16) {
+			SCHED(m0, m1, m2, m3);
+			QROUND(m0, i);
+			SCHED(m1, m2, m3, m0);
+			QROUND(m1, i + 4);
+			SCHED(m2, m3, m0, m1);
+			QROUND(m2, i + 8);
+			SCHED(m3, m0, m1, m2);
+			QROUND(m3, i + 12);
+		}
+
+		s0 = _mm_add_epi32(s0, save0);
+		s1 = _mm_add_epi32(s1, save1);
+	}
+
+	t  = _mm_shuffle_epi32(s0, 0x1B);
+	s1 = _mm_shuffle_epi32(s1, 0xB1);
+	_mm_storeu_si128((__m128i *)&s[0], _mm_blend_epi16(t, s1, 0xF0));
+	_mm_storeu_si128((__m128i *)&s[4], _mm_alignr_epi8(s1, t, 8));
+}
+#endif
+
+#ifdef HAVE_X86
+#define VROR(x, k)  _mm256_or_si256(_mm256_srli_epi32((x), (k)), \
+                                    _mm256_slli_epi32((x), 32 - (k)))
+#define VADD(x, y)  _mm256_add_epi32((x), (y))
+#define VXOR(x, y)  _mm256_xor_si256((x), (y))
+#define VAND(x, y)  _mm256_and_si256((x), (y))
+#define VCh(a,b,c)  VXOR(c, VAND(a, VXOR(b, c)))
+#define VMaj(a,b,c) _mm256_or_si256(VAND(a, b), VAND(c, _mm256_or_si256(a, b)))
+#define VG0(x)      VXOR(VXOR(VROR(x, 7), VROR(x, 18)), _mm256_srli_epi32(x, 3))
+#define VG1(x)      VXOR(VXOR(VROR(x, 17), VROR(x, 19)), _mm256_srli_epi32(x, 10))
+#define VS0(x)      VXOR(VXOR(VROR(x, 2), VROR(x, 13)), VROR(x, 22))
+#define VS1(x)      VXOR(VXOR(VROR(x, 6), VROR(x, 11)), VROR(x, 25))
+
+/* rows of eight words into columns, its own inverse */
+__attribute__((target("avx2")))
+static void
+transpose(__m256i *r)
+{
+	__m256i t[8], u[8];
+	int i;
+
+	for (i = 0; i < 8; i += 2) {
+		t[i]     = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+
+	for (i = 0; i < 8; i += 4) {
+		u[i]     = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+
+	for (i = 0; i < 4; i++) {
+		r[i]     = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+/* one message in each 32 bit lane of the vectors */
+__attribute__((target("avx2")))
+static void
+sha256_avx2(union hash_state **md, const uint8_t **in, size_t n)
+{
+	const __m256i bswap = _mm256_set_epi8(
+	    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+	    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i W[16], s[8], a, b, c, d, e, f, g, h, t0, t1;
+	size_t k;
+	int i, j;
+
+	for (j = 0; j < MBLANES; j++)
+		s[j] = _mm256_loadu_si256((const __m256i *)md[j]->sha256.state);
+	transpose(s);
+
+	for (k = 0; k < n; k++) {
+		for (i = 0; i < 16; i += 8) {
+			for (j = 0; j < MBLANES; j++)
+				W[i + j] = _mm256_loadu_si256((const __m256i *)
+				           (in[j] + 64 * k + 4 * i));
+			transpose(W + i);
+			for (j = 0; j < 8; j++)
+				W[i + j] = _mm256_shuffle_epi8(W[i + j], bswap);
+		}
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		e = s[4];
+		f = s[5];
+		g = s[6];
+		h = s[7];
+
+		for (i = 0; i < 64; i++) {
+			if (i >= 16)
+				W[i & 15] = VADD(VADD(VG1(W[(i - 2) & 15]),
+				            W[(i - 7) & 15]),
+				            VADD(VG0(W[(i - 15) & 15]), W[i & 15]));
+			t0 = VADD(VADD(VADD(h, VS1(e)), VADD(VCh(e, f, g),
+			     _mm256_set1_epi32(K[i]))), W[i & 15]);
+			t1 = VADD(VS0(a), VMaj(a, b, c));
+			h = g;
+			g = f;
+			f = e;
+			e = VADD(d, t0);
+			d = c;
+			c = b;
+			b = a;
+			a = VADD(t0, t1);
+		}
+
+		s[0] = VADD(s[0], a);
+		s[1] = VADD(s[1], b);
+		s[2] = VADD(s[2], c);
+		s[3] = VADD(s[3], d);
+		s[4] = VADD(s[4], e);
+		s[5] = VADD(s[5], f);
+		s[6] = VADD(s[6], g);
+		s[7] = VADD(s[7], h);
+	}
+
+	transpose(s);
+	for (j = 0; j < MBLANES; j++) {
+		_mm256_storeu_si256((__m256i *)md[j]->sha256.state, s[j]);
+		md[j]->sha256.length += 64 * n;
 	}
+}
+#endif
 
-	md->sha256.state[0] += a;
-	md->sha256.state[1] += b;
-	md->sha256.state[2] += c;
-	md->sha256.state[3] += d;
-	md->sha256.state[4] += e;
-	md->sha256.state[5] += f;
-	md->sha256.state[6] += g;
-	md->sha256.state[7] += h;
+static void
+pick(void)
+{
+	compress = sha256_compress;
+#ifdef HAVE_X86
+	if (cpu_has(CPU_SHA|CPU_SSE41|CPU_SSSE3))
+		compress = sha256_shani;
+#endif
+}
+
+/*
+ * the lanes function when it beats hashing one message at a time, the
+ * SHA extensions go faster on their own
+ */
+lanefn *
+sha256_lanes(void)
+{
+#ifdef HAVE_X86
+	if (cpu_has(CPU_AVX2) && !cpu_has(CPU_SHA|CPU_SSE41|CPU_SSSE3))
+		return sha256_avx2;
+#endif
+	return NULL;
 }
 
 void
 sha256_init(union hash_state *md)
 {
+	pthread_once(&once, pick);
+
 	md->sha256.length   = 0;
 	md->sha256.state[0] = 0x6A09E667UL;
 	md->sha256.state[1] = 0xBB67AE85UL;
@@ -104,10 +319,11 @@ sha256_process(union hash_state *md, uint8_t *in, unsigned long len)
 		memcpy(md->sha256.buf + r, in, 64 - r);
 		len -= 64 - r;
 		in  += 64 - r;
-		sha256_compress(md, md->sha256.buf);
+		compress(md->sha256.state, md->sha256.buf, 1);
 	}
-	for (; len >= 64; len -= 64, in += 64)
-		sha256_compress(md, in);
+	compress(md->sha256.state, in, len / 64);
+	in  += len & ~63UL;
+	len &= 63;
 	memcpy(md->sha256.buf, in, len);
 }
 
@@ -121,14 +337,14 @@ sha256_done(union hash_state *md, uint8_t *out)
 	md->sha256.buf[r++] = 0x80;
 	if (r > 56) {
 		memset(md->sha256.buf + r, 0, 64 - r);
-		sha256_compress(md, md->sha256.buf);
+		compress(md->sha256.state, md->sha256.buf, 1);
 		r = 0;
 	}
 
 	memset(md->sha256.buf + r, 0, 56 - r);
 	md->sha256.length *= 8;
 	STORE64H(md->sha256.length, md->sha256.buf + 56);
-	sha256_compress(md, md->sha256.buf);
+	compress(md->sha256.state, md->sha256.buf, 1);
 
 	for (i = 0; i < 8; i++)
 		STORE32H(md->sha256.state[i], out + (4 * i));
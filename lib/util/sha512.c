@@ -1,10 +1,15 @@
 /* implementation based on libtomcrypt */
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "util.h"
 #include "crypto.h"
 
+#ifdef HAVE_X86
+#include <immintrin.h>
+#endif
+
 #define REV(a,b,c,d,e,f,g,h) h=g;g=f;f=e;e=d+t0;d=c;c=b;b=a;a=t0+t1;
 #define Ch(a,b,c)  ((c ^ (a & (b ^ c))))
 #define Maj(a,b,c) ((a & b) | (c & (a | b)))
@@ -57,52 +62,156 @@ static const uint64_t K[80] = {
 	0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
 };
 
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static void (*compress)(uint64_t *, const uint8_t *, size_t);
+
 static uint64_t
 ror(uint64_t n, int k)
 {
 	return ((n >> k) | (n << (64 - k)));
 }
 
-void
-sha512_compress(union hash_state *md, unsigned char *buf)
+static void
+sha512_compress(uint64_t *s, const uint8_t *buf, size_t n)
 {
 	uint64_t W[80], a, b, c, d, e, f, g, h, t0, t1;
 	int i;
 
-	for (i = 0; i < 16; i++)
-		LOAD64H(W[i], buf + (8 * i));
-
-	for (i = 16; i < 80; i++)
-		W[i] = G1(W[i - 2]) + W[i - 7] + G0(W[i - 15]) + W[i - 16];
-
-	a = md->sha512.state[0];
-	b = md->sha512.state[1];
-	c = md->sha512.state[2];
-	d = md->sha512.state[3];
-	e = md->sha512.state[4];
-	f = md->sha512.state[5];
-	g = md->sha512.state[6];
-	h = md->sha512.state[7];
-
-	for (i = 0; i < 80; i++) {
-		t0 = h + S1(e) + Ch(e, f, g) + K[i] + W[i];
-		t1 = S0(a) + Maj(a, b, c);
-		REV(a,b,c,d,e,f,g,h);
+	for (; n; n--, buf += 128) {
+		for (i = 0; i < 16; i++)
+			LOAD64H(W[i], buf + (8 * i));
+
+		for (i = 16; i < 80; i++)
+			W[i] = G1(W[i - 2]) + W[i - 7] + G0(W[i - 15]) +
+			       W[i - 16];
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		e = s[4];
+		f = s[5];
+		g = s[6];
+		h = s[7];
+
+		for (i = 0; i < 80; i++) {
+			t0 = h + S1(e) + Ch(e, f, g) + K[i] + W[i];
+			t1 = S0(a) + Maj(a, b, c);
+			REV(a,b,c,d,e,f,g,h);
+		}
+
+		s[0] += a;
+		s[1] += b;
+		s[2] += c;
+		s[3] += d;
+		s[4] += e;
+		s[5] += f;
+		s[6] += g;
+		s[7] += h;
+	}
+}
+
+#ifdef HAVE_X86
+#define VROR(x, k) _mm256_or_si256(_mm256_srli_epi64((x), (k)), \
+                                   _mm256_slli_epi64((x), 64 - (k)))
+#define VG0(x)     _mm256_xor_si256(_mm256_xor_si256(VROR(x, 1), VROR(x, 8)), \
+                                    _mm256_srli_epi64(x, 7))
+#define VG1(x)     _mm256_xor_si256(_mm256_xor_si256(VROR(x, 19), VROR(x, 61)), \
+                                    _mm256_srli_epi64(x, 6))
+
+/* a round that leaves its result in d and h, the caller renames */
+#define RND(a,b,c,d,e,f,g,h,i) do { \
+	t0 = h + S1(e) + Ch(e, f, g) + WK[i]; \
+	t1 = S0(a) + Maj(a, b, c); \
+	d += t0; \
+	h  = t0 + t1; \
+} while (0)
+
+/* the schedule four words at a time, the rounds on BMI2 rotates */
+__attribute__((target("avx2,bmi2")))
+static void
+sha512_avx2(uint64_t *s, const uint8_t *buf, size_t n)
+{
+	const __m256i bswap = _mm256_set_epi8(
+	    8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+	    8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i w[20], x, y;
+	uint64_t WK[80], a, b, c, d, e, f, g, h, t0, t1;
+	int i;
+
+	for (; n; n--, buf += 128) {
+		for (i = 0; i < 4; i++)
+			w[i] = _mm256_shuffle_epi8(_mm256_loadu_si256(
+			       (const __m256i *)(buf + 32 * i)), bswap);
+
+		/*
+		 * W[t-15..t-12] and W[t-7..t-4] straddle two vectors, and
+		 * the upper pair needs the sigma of the lower one first
+		 */
+		for (i = 4; i < 20; i++) {
+			x = _mm256_alignr_epi8(_mm256_permute2x128_si256(w[i - 4],
+			    w[i - 3], 0x21), w[i - 4], 8);
+			y = _mm256_alignr_epi8(_mm256_permute2x128_si256(w[i - 2],
+			    w[i - 1], 0x21), w[i - 2], 8);
+			x = _mm256_add_epi64(_mm256_add_epi64(w[i - 4], VG0(x)), y);
+			y = _mm256_permute2x128_si256(w[i - 1], w[i - 1], 0x81);
+			x = _mm256_add_epi64(x, VG1(y));
+			y = _mm256_permute2x128_si256(x, x, 0x08);
+			w[i] = _mm256_add_epi64(x, VG1(y));
+		}
+
+		for (i = 0; i < 20; i++)
+			_mm256_storeu_si256((__m256i *)&WK[4 * i],
+			    _mm256_add_epi64(w[i],
+			    _mm256_loadu_si256((const __m256i *)&K[4 * i])));
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		e = s[4];
+		f = s[5];
+		g = s[6];
+		h = s[7];
+
+		for (i = 0; i < 80; i += 8) {
+			RND(a,b,c,d,e,f,g,h,i);
+			RND(h,a,b,c,d,e,f,g,i + 1);
+			RND(g,h,a,b,c,d,e,f,i + 2);
+			RND(f,g,h,a,b,c,d,e,i + 3);
+			RND(e,f,g,h,a,b,c,d,i + 4);
+			RND(d,e,f,g,h,a,b,c,i + 5);
+			RND(c,d,e,f,g,h,a,b,i + 6);
+			RND(b,c,d,e,f,g,h,a,i + 7);
+		}
+
+		s[0] += a;
+		s[1] += b;
+		s[2] += c;
+		s[3] += d;
+		s[4] += e;
+		s[5] += f;
+		s[6] += g;
+		s[7] += h;
 	}
+}
+#endif
 
-	md->sha512.state[0] += a;
-	md->sha512.state[1] += b;
-	md->sha512.state[2] += c;
-	md->sha512.state[3] += d;
-	md->sha512.state[4] += e;
-	md->sha512.state[5] += f;
-	md->sha512.state[6] += g;
-	md->sha512.state[7] += h;
+static void
+pick(void)
+{
+	compress = sha512_compress;
+#ifdef HAVE_X86
+	if (cpu_has(CPU_AVX2|CPU_BMI2))
+		compress = sha512_avx2;
+#endif
 }
 
 void
 sha512_init(union hash_state *md)
 {
+	pthread_once(&once, pick);
+
 	md->sha512.length   = 0;
 	md->sha512.state[0] = 0x6a09e667f3bcc908ULL;
 	md->sha512.state[1] = 0xbb67ae8584caa73bULL;
@@ -129,10 +238,11 @@ sha512_process(union hash_state *md, uint8_t *in, unsigned long len)
 		memcpy(md->sha512.buf + r, in, 128 - r);
 		len -= 128 - r;
 		in  += 128 - r;
-		sha512_compress(md, md->sha512.buf);
+		compress(md->sha512.state, md->sha512.buf, 1);
 	}
-	for (; len >= 128; len -= 128, in += 128)
-		sha512_compress(md, in);
+	compress(md->sha512.state, in, len / 128);
+	in  += len & ~127UL;
+	len &= 127;
 	memcpy(md->sha512.buf, in, len);
 }
 
@@ -146,14 +256,14 @@ sha512_done(union hash_state *md, unsigned char *out)
 	md->sha512.buf[r++] = 0x80;
 	if (r > 112) {
 		memset(md->sha512.buf + r, 0, 128 - r);
-		sha512_compress(md, md->sha512.buf);
+		compress(md->sha512.state, md->sha512.buf, 1);
 		r = 0;
 	}
 
 	memset(md->sha512.buf + r, 0, 120 - r);
 	md->sha512.length *= 8;
 	STORE64H(md->sha512.length, md->sha512.buf + 120);
-	sha512_compress(md, md->sha512.buf);
+	compress(md->sha512.state, md->sha512.buf, 1);
 
 	for (i = 0; i < 8; i++)
 		STORE64H(md->sha512.state[i], out + (8 * i));
@@ -0,0 +1,87 @@
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "util.h"
+
+#ifdef STATX_TYPE
+static int nostatx;
+
+unsigned int
+statxmask(int need)
+{
+	unsigned int mask;
+
+	mask = STATX_TYPE;
+
+	if (need & FS_MODE)
+		mask |= STATX_MODE;
+	if (need & FS_NLINK)
+		mask |= STATX_NLINK;
+	if (need & FS_OWNER)
+		mask |= STATX_UID|STATX_GID;
+	if (need & FS_TIME)
+		mask |= STATX_ATIME|STATX_MTIME|STATX_CTIME;
+	if (need & FS_INO)
+		mask |= STATX_INO;
+	if (need & FS_SIZE)
+		mask |= STATX_SIZE;
+	if (need & FS_BLOCKS)
+		mask |= STATX_BLOCKS;
+
+	return mask;
+}
+
+void
+statxfill(struct stat *st, struct statx *stx)
+{
+	memset(st, 0, sizeof(*st));
+
+	st->st_dev     = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino     = stx->stx_ino;
+	st->st_mode    = stx->stx_mode;
+	st->st_nlink   = stx->stx_nlink;
+	st->st_uid     = stx->stx_uid;
+	st->st_gid     = stx->stx_gid;
+	st->st_rdev    = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size    = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks  = stx->stx_blocks;
+
+	st->st_atim.tv_sec  = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec  = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec  = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+#endif
+
+/* only the fields asked for in need are meaningful, st_dev always is */
+int
+fs_stat(int fd, const char *name, struct stat *st, int flags, int need)
+{
+#ifdef STATX_TYPE
+	struct statx stx;
+
+	if (!nostatx) {
+		if (need & FS_NOSYNC)
+			flags |= AT_STATX_DONT_SYNC;
+
+		if (statx(fd, name, flags, statxmask(need), &stx) == 0) {
+			statxfill(st, &stx);
+			return 0;
+		}
+
+		if (errno != ENOSYS)
+			return -1;
+
+		/* old kernel, it will not change during the run */
+		nostatx = 1;
+		flags &= ~AT_STATX_DONT_SYNC;
+	}
+#endif
+	return fstatat(fd, name, st, flags);
+}
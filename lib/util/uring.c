@@ -0,0 +1,395 @@
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#define HAVE_URING
+#endif
+#endif
+
+#if defined(HAVE_URING) && defined(STATX_TYPE)
+#define RING  256
+#define RETRY 16  /* io_uring_enter failures in a row worth retrying */
+
+enum {
+	OPSTAT   = 0x1,
+	OPUNLINK = 0x2
+};
+
+struct ring {
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	struct statx stx[RING];
+	void *sqmap;   /* the three mappings, cqmap may be sqmap */
+	void *cqmap;
+	size_t sqlen;
+	size_t cqlen;
+	size_t sqeslen;
+	unsigned *sqhead;
+	unsigned *sqtail;
+	unsigned *sqmask;
+	unsigned *sqarray;
+	unsigned *cqhead;
+	unsigned *cqtail;
+	unsigned *cqmask;
+	unsigned entries;
+	unsigned lost;  /* entries given up on, the kernel may still write */
+	int fd;
+	int ops;
+};
+
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int nouring; /* read and set atomically, any thread may fail */
+
+static int
+probe(int fd)
+{
+	struct io_uring_probe *pr;
+	size_t len;
+	int ops;
+
+	ops = 0;
+	len = sizeof(*pr) + 256 * sizeof(pr->ops[0]);
+	pr  = emalloc(len);
+	memset(pr, 0, len);
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+	    pr, 256) == 0) {
+		if (IORING_OP_STATX < pr->ops_len &&
+		    (pr->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED))
+			ops |= OPSTAT;
+		if (IORING_OP_UNLINKAT < pr->ops_len &&
+		    (pr->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED))
+			ops |= OPUNLINK;
+	}
+
+	free(pr);
+
+	return ops;
+}
+
+static struct ring *
+ringinit(void)
+{
+	struct io_uring_params p;
+	struct ring *r;
+	size_t cqlen, sqeslen, sqlen;
+	char *cq, *sq;
+	void *sqes;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	if ((fd = syscall(__NR_io_uring_setup, RING, &p)) < 0)
+		return NULL;
+
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqlen > sqlen)
+		sqlen = cqlen;
+
+	sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	cq = MAP_FAILED;
+	sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	          fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto failure;
+
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) &&
+	    (cq = mmap(NULL, cqlen, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto failure;
+
+	sqes = mmap(NULL, sqeslen, PROT_READ|PROT_WRITE,
+	            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto failure;
+
+	/* the mappings last as long as the thread */
+	r = emalloc(sizeof(*r));
+	r->fd      = fd;
+	r->sqmap   = sq;
+	r->cqmap   = cq;
+	r->sqlen   = sqlen;
+	r->cqlen   = cqlen;
+	r->sqeslen = sqeslen;
+	r->ops     = probe(fd);
+	r->entries = p.sq_entries;
+	r->lost    = 0;
+	r->sqes    = sqes;
+	r->sqhead  = (unsigned *)(sq + p.sq_off.head);
+	r->sqtail  = (unsigned *)(sq + p.sq_off.tail);
+	r->sqmask  = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sqarray = (unsigned *)(sq + p.sq_off.array);
+	r->cqes    = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->cqhead  = (unsigned *)(cq + p.cq_off.head);
+	r->cqtail  = (unsigned *)(cq + p.cq_off.tail);
+	r->cqmask  = (unsigned *)(cq + p.cq_off.ring_mask);
+
+	return r;
+failure:
+	if (cq != MAP_FAILED && cq != sq)
+		munmap(cq, cqlen);
+	if (sq != MAP_FAILED)
+		munmap(sq, sqlen);
+	close(fd);
+	return NULL;
+}
+
+static void
+ringfree(void *p)
+{
+	struct ring *r;
+
+	r = p;
+	munmap(r->sqes, r->sqeslen);
+	if (r->cqmap != r->sqmap)
+		munmap(r->cqmap, r->cqlen);
+	munmap(r->sqmap, r->sqlen);
+	close(r->fd);
+	/* a late statx may still land in r->stx */
+	if (!r->lost)
+		free(r);
+}
+
+static void
+mkkey(void)
+{
+	pthread_key_create(&key, ringfree);
+}
+
+/* one ring per thread, set up on first use */
+static struct ring *
+getring(int op)
+{
+	struct ring *r;
+
+	if (__atomic_load_n(&nouring, __ATOMIC_RELAXED))
+		return NULL;
+
+	pthread_once(&once, mkkey);
+
+	if (!(r = pthread_getspecific(key))) {
+		if (!(r = ringinit())) {
+			__atomic_store_n(&nouring, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		pthread_setspecific(key, r);
+	}
+
+	return (r->ops & op) ? r : NULL;
+}
+
+static struct io_uring_sqe *
+getsqe(struct ring *r, unsigned *tail)
+{
+	struct io_uring_sqe *sqe;
+	unsigned i;
+
+	i   = *tail & *r->sqmask;
+	sqe = &r->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sqarray[i] = i;
+	(*tail)++;
+
+	return sqe;
+}
+
+/* move what completed into res[user_data] */
+static unsigned
+reap(struct ring *r, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, n;
+
+	head = *r->cqhead;
+	for (n = 0; head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+	    head++, n++) {
+		cqe = &r->cqes[head & *r->cqmask];
+		res[cqe->user_data] = cqe->res;
+	}
+	__atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/*
+ * submit the n entries queued with user_data 0 to n-1 and wait for all of
+ * them, res[user_data] gets each result. a ring that fails, or keeps
+ * being interrupted, is not used again: the entries it never ran are left
+ * at 1, the ones it may still be running at 2.
+ */
+static void
+run(struct ring *r, unsigned tail, unsigned n, int *res)
+{
+	unsigned done, i, sent, tries;
+	int rv;
+
+	__atomic_store_n(r->sqtail, tail, __ATOMIC_RELEASE);
+
+	for (done = sent = tries = 0; done < n;) {
+		rv = syscall(__NR_io_uring_enter, r->fd, n - sent, 1,
+		             IORING_ENTER_GETEVENTS, NULL, 0);
+		if (rv < 0 && ((errno != EINTR && errno != EAGAIN) ||
+		    ++tries > RETRY))
+			break;
+		if (rv >= 0)
+			tries = 0;
+		if (rv > 0)
+			sent += rv;
+
+		done += reap(r, res);
+	}
+
+	if (done == n)
+		return;
+
+	__atomic_store_n(r->sqtail,
+	    __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	r->ops = 0;
+
+	done += reap(r, res);
+	r->lost = sent - done;
+	for (i = 0; i < sent; i++)
+		if (res[i] == 1)
+			res[i] = 2;
+}
+#endif
+
+/* stat every entry, through io_uring when the kernel has it */
+void
+fs_statv(int fd, struct fs_ent **ents, const char *pool, size_t n, int flags,
+         int need)
+{
+	size_t i;
+#if defined(HAVE_URING) && defined(STATX_TYPE)
+	struct io_uring_sqe *sqe;
+	struct ring *r;
+	size_t j, len;
+	unsigned int mask;
+	unsigned tail;
+	int res[RING];
+
+	if ((r = getring(OPSTAT)) && n > 1) {
+		mask = statxmask(need);
+		if (need & FS_NOSYNC)
+			flags |= AT_STATX_DONT_SYNC;
+
+		for (i = 0; i < n; i += len) {
+			len  = MIN(n - i, r->entries);
+			tail = *r->sqtail;
+
+			for (j = 0; j < len; j++) {
+				res[j] = 1;
+				sqe = getsqe(r, &tail);
+				sqe->opcode      = IORING_OP_STATX;
+				sqe->fd          = fd;
+				sqe->addr        = (uintptr_t)(pool + ents[i + j]->off);
+				sqe->len         = mask;
+				sqe->off         = (uintptr_t)&r->stx[j];
+				sqe->statx_flags = flags;
+				sqe->user_data   = j;
+			}
+
+			run(r, tail, len, res);
+
+			for (j = 0; j < len; j++) {
+				if (res[j] > 0)
+					break;
+				ents[i + j]->err = -res[j];
+				if (!res[j])
+					statxfill(&ents[i + j]->info, &r->stx[j]);
+			}
+
+			if (j < len) {
+				i += j;
+				flags &= ~AT_STATX_DONT_SYNC;
+				break;
+			}
+		}
+	} else {
+		i = 0;
+	}
+#else
+	i = 0;
+#endif
+	for (; i < n; i++) {
+		ents[i]->err = 0;
+		if (fs_stat(fd, pool + ents[i]->off, &ents[i]->info,
+		    flags, need) < 0)
+			ents[i]->err = errno;
+	}
+}
+
+/* unlink every name relative to fd, errs gets each errno */
+void
+fs_unlinkv(int fd, char **names, int *errs, size_t n)
+{
+	size_t i;
+#if defined(HAVE_URING) && defined(STATX_TYPE)
+	struct io_uring_sqe *sqe;
+	struct ring *r;
+	size_t j, len;
+	unsigned tail;
+	int res[RING];
+
+	if ((r = getring(OPUNLINK)) && n > 1) {
+		for (i = 0; i < n; i += len) {
+			len  = MIN(n - i, r->entries);
+			tail = *r->sqtail;
+
+			for (j = 0; j < len; j++) {
+				res[j] = 1;
+				sqe = getsqe(r, &tail);
+				sqe->opcode    = IORING_OP_UNLINKAT;
+				sqe->fd        = fd;
+				sqe->addr      = (uintptr_t)names[i + j];
+				sqe->user_data = j;
+			}
+
+			run(r, tail, len, res);
+
+			/*
+			 * whatever did not run is done here. one the ring may
+			 * have run already is gone, that is no error
+			 */
+			for (j = 0; j < len; j++) {
+				if (res[j] <= 0)
+					errs[i + j] = -res[j];
+				else if (unlinkat(fd, names[i + j], 0) < 0)
+					errs[i + j] = (res[j] == 2 &&
+					    errno == ENOENT) ? 0 : errno;
+				else
+					errs[i + j] = 0;
+			}
+
+			if (!r->ops) {
+				i += len;
+				break;
+			}
+		}
+	} else {
+		i = 0;
+	}
+#else
+	i = 0;
+#endif
+	for (; i < n; i++)
+		errs[i] = (unlinkat(fd, names[i], 0) < 0) ? errno : 0;
+}
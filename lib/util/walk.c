@@ -0,0 +1,834 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/* directories kept open for their pending subdirectories */
+struct fdcache {
+	pthread_mutex_t lock;
+	FS_NODE *head; /* most recently used */
+	FS_NODE *tail;
+	int len;
+	int max;
+};
+
+enum {
+	OHEAD = 1, /* obuf is final */
+	OTAIL = 2  /* tbuf too */
+};
+
+struct wctx {
+	struct fs_walk *w;
+	struct fdcache fc;
+	pthread_mutex_t olock;
+	FS_NODE *root;
+	FS_NODE *ocur;  /* the first node whose output is not all out */
+	size_t rlen;    /* root path without its trailing slash */
+	int ostage;     /* what of ocur is next: OHEAD, its children, OTAIL */
+	int mt;
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	FS_NODE **tab;
+	size_t cap;
+	size_t head;
+	size_t tail;
+};
+
+struct pwalk {
+	struct wctx *c;
+	struct deque *dq;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int nthreads;
+	int idle;
+	int done;
+};
+
+struct worker {
+	struct pwalk *pw;
+	int id;
+};
+
+int fs_jobs = 1;
+
+static FS_NODE *
+newnode(FS_NODE *parent, const char *name, size_t len)
+{
+	FS_NODE *n;
+
+	n = emalloc(sizeof(*n));
+	memset(n, 0, sizeof(*n));
+
+	n->name = emalloc(len + 1);
+	memcpy(n->name, name, len);
+	n->name[len] = '\0';
+	n->nlen = len;
+
+	n->at  = AT_FDCWD;
+	n->fd  = -1;
+	n->tfd = -1;
+
+	if ((n->parent = parent)) {
+		n->depth = parent->depth + 1;
+		n->data  = parent->data;
+	}
+
+	return n;
+}
+
+static void
+freenode(FS_NODE *n)
+{
+	free(n->obuf);
+	free(n->tbuf);
+	free(n->path);
+	free(n->name);
+	free(n);
+}
+
+static int
+slash(FS_NODE *n)
+{
+	FS_NODE *p;
+
+	p = n->parent;
+
+	return p && (!p->nlen || p->name[p->nlen - 1] != '/');
+}
+
+/* paths are only built while a callback needs them */
+static char *
+mkpath(FS_NODE *n)
+{
+	FS_NODE *p;
+	size_t len;
+	char *s;
+
+	for (len = 0, p = n; p; p = p->parent)
+		len += p->nlen + slash(p);
+
+	s = emalloc(len + 1);
+	s[len] = '\0';
+
+	for (p = n; p; p = p->parent) {
+		len -= p->nlen;
+		memcpy(s + len, p->name, p->nlen);
+		if (slash(p))
+			s[--len] = '/';
+	}
+
+	return s;
+}
+
+/*
+ * descriptors the cache may hold: the soft limit less stdio, the directory
+ * and its mirror each of the nthreads walking has open, and the files one
+ * of fs_jobs threads copies and verifies at once, whether the walk or a
+ * pool of its own does the copying. $UTILCHEST_FDMAX can only lower it.
+ */
+static int
+fdmax(int nthreads)
+{
+	struct rlimit rl;
+	long max;
+	char *s;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+		max = 256;
+	else
+		max = (long)MIN(rl.rlim_cur, INT_MAX) - 3 - 2L * nthreads -
+		    3L * fs_jobs;
+
+	if ((s = getenv("UTILCHEST_FDMAX")))
+		max = MIN(max, strtobase(s, 0, INT_MAX, 10));
+
+	/* nothing cached means every directory is opened again by name */
+	return (max < 0) ? 0 : max;
+}
+
+/* descriptor cache, the lock is held by the callers */
+static void
+lrudel(struct fdcache *fc, FS_NODE *n)
+{
+	if (n->lprev)
+		n->lprev->lnext = n->lnext;
+	else
+		fc->head = n->lnext;
+
+	if (n->lnext)
+		n->lnext->lprev = n->lprev;
+	else
+		fc->tail = n->lprev;
+
+	n->lprev = n->lnext = NULL;
+}
+
+static void
+lrupush(struct fdcache *fc, FS_NODE *n)
+{
+	n->lprev = NULL;
+	n->lnext = fc->head;
+
+	if (fc->head)
+		fc->head->lprev = n;
+	else
+		fc->tail = n;
+
+	fc->head = n;
+}
+
+static void
+drop(struct fdcache *fc, FS_NODE *n)
+{
+	lrudel(fc, n);
+
+	close(n->fd);
+	n->fd = -1;
+	fc->len--;
+
+	if (n->tfd >= 0) {
+		close(n->tfd);
+		n->tfd = -1;
+		fc->len--;
+	}
+}
+
+static void
+trim(struct fdcache *fc)
+{
+	FS_NODE *n, *prev;
+
+	for (n = fc->tail; n && fc->len > fc->max; n = prev) {
+		prev = n->lprev;
+		if (!n->users)
+			drop(fc, n);
+	}
+}
+
+static void
+keep(struct fdcache *fc, FS_NODE *n)
+{
+	lrupush(fc, n);
+	fc->len += 1 + (n->tfd >= 0);
+	trim(fc);
+}
+
+/* open n again by name from the closest ancestor still open */
+static int
+reopen(struct wctx *c, FS_NODE *n)
+{
+	struct stat st;
+	FS_NODE **chain, *p, *q;
+	int i, len, rval;
+
+	for (len = 0, p = n; p->fd < 0; p = p->parent)
+		len++;
+
+	chain = emalloc(len * sizeof(*chain));
+	for (i = len, q = n; q != p; q = q->parent)
+		chain[--i] = q;
+
+	rval = 0;
+	p->users++;
+
+	for (i = 0; i < len; i++, p = q) {
+		q = chain[i];
+
+		if ((q->fd = openat(p->fd, q->name,
+		    O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+			rval = -1;
+			break;
+		}
+
+		/* it must still be the directory that was read */
+		rval = fstat(q->fd, &st);
+		if (!rval && (st.st_dev != q->dev || st.st_ino != q->ino)) {
+			errno = ESTALE;
+			rval  = -1;
+		}
+
+		if (rval < 0) {
+			close(q->fd);
+			q->fd = -1;
+			break;
+		}
+
+		if (c->w->mirror && (q->tfd = openat(p->tfd, q->name,
+		    O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+			close(q->fd);
+			q->fd = -1;
+			rval  = -1;
+			break;
+		}
+
+		p->users--;
+		q->users++;
+		keep(&c->fc, q);
+	}
+
+	p->users--;
+	free(chain);
+
+	return rval;
+}
+
+/* n keeps its descriptors until released */
+static int
+hold(struct wctx *c, FS_NODE *n)
+{
+	int rval;
+
+	rval = 0;
+	pthread_mutex_lock(&c->fc.lock);
+
+	if (n->fd < 0 && reopen(c, n) < 0) {
+		rval = -1;
+	} else {
+		n->users++;
+		if (n->parent) {
+			lrudel(&c->fc, n);
+			lrupush(&c->fc, n);
+		}
+	}
+
+	pthread_mutex_unlock(&c->fc.lock);
+
+	return rval;
+}
+
+static void
+release(struct wctx *c, FS_NODE *n)
+{
+	pthread_mutex_lock(&c->fc.lock);
+	n->users--;
+	trim(&c->fc);
+	pthread_mutex_unlock(&c->fc.lock);
+}
+
+/*
+ * write out, in the order of a serial walk, whatever output is final up to
+ * the first directory still being worked on. each node is its head, its
+ * children and its tail; a child is freed once it is all out.
+ */
+static void
+emit(struct wctx *c, FS_NODE *n, int ready)
+{
+	FS_NODE *p;
+
+	pthread_mutex_lock(&c->olock);
+	n->ready = ready;
+
+	for (n = c->ocur; n;) {
+		if (c->ostage == OHEAD) {
+			if (n->ready < OHEAD)
+				break;
+			fwrite(n->obuf, 1, n->olen, stdout);
+			free(n->obuf);
+			n->obuf = NULL;
+			c->ostage = 0;
+		}
+
+		if (!c->ostage && n->child) {
+			n = c->ocur = n->child;
+			c->ostage = OHEAD;
+			continue;
+		}
+
+		if (n->ready < OTAIL)
+			break;
+		fwrite(n->tbuf, 1, n->tlen, stdout);
+		free(n->tbuf);
+		n->tbuf = NULL;
+
+		if (!(p = n->parent)) {
+			c->ocur = NULL;
+			break;
+		}
+		if (!(p->child = n->next))
+			p->last = NULL;
+		freenode(n);
+		n = c->ocur = p;
+		c->ostage = 0;
+	}
+
+	pthread_mutex_unlock(&c->olock);
+}
+
+/* read a directory, queueing the subdirectories to descend */
+static int
+scan(struct wctx *c, FS_NODE *n)
+{
+	struct fs_walk *w;
+	FS_NODE *p;
+	FS_DIR *dir;
+	int rd;
+
+	w   = c->w;
+	p   = n->parent;
+	dir = emalloc(sizeof(*dir));
+	n->path = mkpath(n);
+
+	if (!p) {
+		rd = open_dir(dir, n->path);
+	} else if (hold(c, p) < 0) {
+		rd = FS_ERR;
+	} else {
+		rd = open_dirat(dir, c->root->dir, p->fd, n->name, n->path);
+		if (rd == FS_OK && w->mirror && (n->tfd = openat(p->tfd,
+		    n->name, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+			warn("open %s%s", w->mirror, n->path + c->rlen);
+			close_dir(dir);
+			n->rval = 1;
+			rd = FS_CONT;
+		}
+		release(c, p);
+	}
+
+	if (rd != FS_OK) {
+		free(dir);
+		if (rd == FS_ERR) {
+			if (!p)
+				return FS_ERR;
+			warn("open_dir %s", n->path);
+			n->rval = 1;
+		}
+		goto done;
+	}
+
+	n->dir = dir;
+	n->dev = dir->dev;
+	n->ino = dir->ino;
+	if (!p && fstat(dir->fd, &n->info) < 0)
+		memset(&n->info, 0, sizeof(n->info));
+
+	if (!c->mt)
+		n->out = stdout;
+	else if (!(n->out = open_memstream(&n->obuf, &n->olen)))
+		err(1, "open_memstream");
+
+	if (w->pre && w->pre(n) == FS_ERR) {
+		n->rval = 1;
+		goto close;
+	}
+
+	if (!p && w->mirror && (n->tfd = open(w->mirror,
+	    O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+		warn("open %s", w->mirror);
+		n->rval = 1;
+		goto close;
+	}
+
+	while ((rd = read_dir(dir, w->need)) == FS_EXEC) {
+		if (w->visit(n, dir) == FS_EXEC && S_ISDIR(dir->info.st_mode))
+			walk_push(n, dir->name, &dir->info);
+	}
+
+	if (rd == FS_ERR) {
+		warn("read_dir %s", dir->path);
+		n->rval = 1;
+	}
+
+	if (w->scan)
+		w->scan(n);
+
+	n->read = 1;
+close:
+	if (c->mt) {
+		fclose(n->out);
+		n->out = NULL;
+	}
+
+	/* the root stays open, it anchors every reopen */
+	if (!p) {
+		n->fd    = dir->fd;
+		n->users = 1;
+	} else {
+		if (n->child && (n->fd = fcntl(dir->fd,
+		    F_DUPFD_CLOEXEC, 0)) >= 0) {
+			pthread_mutex_lock(&c->fc.lock);
+			keep(&c->fc, n);
+			pthread_mutex_unlock(&c->fc.lock);
+		} else if (n->tfd >= 0) {
+			close(n->tfd);
+			n->tfd = -1;
+		}
+		close_dir(dir);
+		free(dir);
+		n->dir = NULL;
+	}
+done:
+	free(n->path);
+	n->path = NULL;
+
+	if (c->mt)
+		emit(c, n, OHEAD);
+
+	return n->read ? FS_OK : FS_CONT;
+}
+
+/* every subdirectory is done: n takes its final metadata and output */
+static void
+done(struct wctx *c, FS_NODE *n)
+{
+	struct fs_walk *w;
+	FS_NODE *ch, *next, *p;
+
+	w = c->w;
+	p = n->parent;
+
+	if (n->read && w->post) {
+		if (c->mt && !(n->out = open_memstream(&n->tbuf, &n->tlen)))
+			err(1, "open_memstream");
+		n->path = mkpath(n);
+		if (!p) {
+			n->rval |= w->post(n);
+		} else if (hold(c, p) < 0) {
+			warn("open_dir %s", n->path);
+			n->rval = 1;
+		} else {
+			n->at    = p->fd;
+			n->rval |= w->post(n);
+			release(c, p);
+		}
+		free(n->path);
+		n->path = NULL;
+		if (c->mt) {
+			fclose(n->out);
+			n->out = NULL;
+		}
+	}
+
+	if (!p) {
+		if (n->tfd >= 0)
+			close(n->tfd);
+		close_dir(n->dir);
+		free(n->dir);
+		n->dir = NULL;
+		n->fd  = n->tfd = -1;
+	} else {
+		if (n->fd >= 0) {
+			pthread_mutex_lock(&c->fc.lock);
+			drop(&c->fc, n);
+			pthread_mutex_unlock(&c->fc.lock);
+		}
+
+		/* siblings may finish at once on other threads */
+		pthread_mutex_lock(&c->olock);
+		p->rval  |= n->rval;
+		p->total += n->total;
+		pthread_mutex_unlock(&c->olock);
+	}
+
+	/* in parallel the children go once they are written out */
+	if (c->mt) {
+		emit(c, n, OTAIL);
+		return;
+	}
+
+	for (ch = n->child; ch; ch = next) {
+		next = ch->next;
+		freenode(ch);
+	}
+	n->child = NULL;
+}
+
+/* depth first without recursion, the tree itself is the stack */
+static void
+walk1(struct wctx *c, FS_NODE *root)
+{
+	FS_NODE *n, *p;
+
+	for (p = root, n = root->child;;) {
+		if (n) {
+			if (scan(c, n) == FS_OK && n->child) {
+				p = n;
+				n = n->child;
+				continue;
+			}
+			done(c, n);
+			n = n->next;
+			continue;
+		}
+
+		done(c, p);
+		if (p == root)
+			return;
+		n = p->next;
+		p = p->parent;
+	}
+}
+
+/* work stealing */
+static void
+push(struct pwalk *pw, int id, FS_NODE *n)
+{
+	struct deque *dq;
+
+	dq = &pw->dq[id];
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail == dq->cap) {
+		if (dq->head) {
+			memmove(dq->tab, dq->tab + dq->head,
+			        (dq->tail - dq->head) * sizeof(*dq->tab));
+			dq->tail -= dq->head;
+			dq->head  = 0;
+		} else {
+			dq->cap = dq->cap ? dq->cap << 1 : 64;
+			if (!(dq->tab = realloc(dq->tab,
+			    dq->cap * sizeof(*dq->tab))))
+				err(1, "realloc");
+		}
+	}
+	dq->tab[dq->tail++] = n;
+	pthread_mutex_unlock(&dq->lock);
+
+	pthread_mutex_lock(&pw->lock);
+	if (pw->idle)
+		pthread_cond_signal(&pw->cond);
+	pthread_mutex_unlock(&pw->lock);
+}
+
+/* the owner takes the newest node, thieves take the oldest */
+static FS_NODE *
+take(struct deque *dq, int steal)
+{
+	FS_NODE *n;
+
+	n = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head != dq->tail) {
+		n = steal ? dq->tab[dq->head++] : dq->tab[--dq->tail];
+		if (dq->head == dq->tail)
+			dq->head = dq->tail = 0;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return n;
+}
+
+static FS_NODE *
+getwork(struct pwalk *pw, int id)
+{
+	FS_NODE *n;
+	int i;
+
+	for (;;) {
+		if ((n = take(&pw->dq[id], 0)))
+			return n;
+
+		for (i = 1; i < pw->nthreads; i++)
+			if ((n = take(&pw->dq[(id + i) % pw->nthreads], 1)))
+				return n;
+
+		pthread_mutex_lock(&pw->lock);
+		for (i = 0; !pw->done && i < pw->nthreads; i++)
+			if (pw->dq[i].head != pw->dq[i].tail)
+				break;
+		if (pw->done) {
+			pthread_mutex_unlock(&pw->lock);
+			return NULL;
+		}
+		if (i == pw->nthreads) {
+			pw->idle++;
+			pthread_cond_wait(&pw->cond, &pw->lock);
+			pw->idle--;
+		}
+		pthread_mutex_unlock(&pw->lock);
+	}
+}
+
+static void
+complete(struct pwalk *pw, FS_NODE *n)
+{
+	FS_NODE *p;
+	long r;
+
+	for (;;) {
+		/* n may be written out and freed by done */
+		p = n->parent;
+		done(pw->c, n);
+
+		if (!p) {
+			pthread_mutex_lock(&pw->lock);
+			pw->done = 1;
+			pthread_cond_broadcast(&pw->cond);
+			pthread_mutex_unlock(&pw->lock);
+			return;
+		}
+
+		pthread_mutex_lock(&pw->lock);
+		r = --p->pending;
+		pthread_mutex_unlock(&pw->lock);
+
+		if (r)
+			return;
+		n = p;
+	}
+}
+
+static void
+dispatch(struct pwalk *pw, int id, FS_NODE *n)
+{
+	FS_NODE *c, *next;
+
+	for (c = n->child; c; c = c->next)
+		n->pending++;
+
+	if (!n->pending) {
+		complete(pw, n);
+		return;
+	}
+
+	/* n may be released as soon as its last child is queued */
+	for (c = n->child; c; c = next) {
+		next = c->next;
+		push(pw, id, c);
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	struct worker *wk;
+	FS_NODE *n;
+
+	wk = arg;
+
+	while ((n = getwork(wk->pw, wk->id))) {
+		if (scan(wk->pw->c, n) == FS_OK)
+			dispatch(wk->pw, wk->id, n);
+		else
+			complete(wk->pw, n);
+	}
+
+	return NULL;
+}
+
+static void
+pwalk(struct wctx *c, FS_NODE *root, int nthreads)
+{
+	struct pwalk pw;
+	struct worker *wk;
+	pthread_t *tid;
+	int i;
+
+	memset(&pw, 0, sizeof(pw));
+	pw.c        = c;
+	pw.nthreads = nthreads;
+	pw.dq       = emalloc(nthreads * sizeof(*pw.dq));
+	memset(pw.dq, 0, nthreads * sizeof(*pw.dq));
+	pthread_mutex_init(&pw.lock, NULL);
+	pthread_cond_init(&pw.cond, NULL);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_mutex_init(&pw.dq[i].lock, NULL);
+
+	wk  = emalloc(nthreads * sizeof(*wk));
+	tid = emalloc(nthreads * sizeof(*tid));
+
+	dispatch(&pw, 0, root);
+
+	for (i = 0; i < nthreads; i++) {
+		wk[i].pw = &pw;
+		wk[i].id = i;
+		if (i && (errno = pthread_create(&tid[i], NULL,
+		    worker, &wk[i])))
+			err(1, "pthread_create");
+	}
+
+	worker(&wk[0]);
+
+	for (i = 1; i < nthreads; i++)
+		pthread_join(tid[i], NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_destroy(&pw.dq[i].lock);
+		free(pw.dq[i].tab);
+	}
+	pthread_cond_destroy(&pw.cond);
+	pthread_mutex_destroy(&pw.lock);
+	free(pw.dq);
+	free(tid);
+	free(wk);
+}
+
+/* external functions */
+void
+walk_push(FS_NODE *n, const char *name, struct stat *st)
+{
+	FS_NODE *c;
+
+	if (ISDOT(name))
+		return;
+
+	c = newnode(n, name, strlen(name));
+	c->info = *st;
+
+	if (n->last)
+		n->last->next = c;
+	else
+		n->child = c;
+	n->last = c;
+}
+
+int
+walk(const char *path, struct fs_walk *w)
+{
+	struct wctx c;
+	FS_NODE *root;
+	int nthreads, rd, rval;
+
+	root = newnode(NULL, path, strlen(path));
+	root->data = w->data;
+
+	memset(&c, 0, sizeof(c));
+	c.w      = w;
+	c.root   = root;
+	c.rlen   = root->nlen;
+	nthreads = w->jobs ? w->jobs : fs_jobs;
+
+	c.mt     = nthreads > 1;
+	c.fc.max = fdmax(nthreads);
+	c.ocur   = root;
+	c.ostage = OHEAD;
+	pthread_mutex_init(&c.fc.lock, NULL);
+	pthread_mutex_init(&c.olock, NULL);
+
+	if (c.rlen && path[c.rlen - 1] == '/')
+		c.rlen--;
+
+	if ((rd = scan(&c, root)) == FS_ERR) {
+		pthread_mutex_destroy(&c.olock);
+		pthread_mutex_destroy(&c.fc.lock);
+		freenode(root);
+		return FS_ERR;
+	}
+
+	if (rd != FS_OK)
+		done(&c, root);
+	else if (c.mt)
+		pwalk(&c, root, nthreads);
+	else
+		walk1(&c, root);
+
+	rval = root->rval;
+	pthread_mutex_destroy(&c.olock);
+	pthread_mutex_destroy(&c.fc.lock);
+	freenode(root);
+
+	return rval;
+}
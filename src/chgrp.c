@@ -11,7 +11,7 @@
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-h] [-R [-H|-L|-P]] group file ...\n",
+	fprintf(stderr, "usage: %s [-h] [-R [-H|-L|-P] [-j jobs]] group file ...\n",
 	        getprogname());
 	exit(1);
 }
@@ -41,6 +41,9 @@ main(int argc, char *argv[])
 	case 'P':
 		fs_follow = ARGC();
 		break;
+	case 'j':
+		fs_jobs = strtobase(EARGF(usage()), 1, INT_MAX, 10);
+		break;
 	default:
 		usage();
 	} ARGEND
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -6,7 +7,7 @@
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-R [-H|-L|-P]] mode file ...\n",
+	fprintf(stderr, "usage: %s [-R [-H|-L|-P] [-j jobs]] mode file ...\n",
 	        getprogname());
 	exit(1);
 }
@@ -31,6 +32,9 @@ main(int argc, char *argv[])
 	case 'P':
 		fs_follow = ARGC();
 		break;
+	case 'j':
+		fs_jobs = strtobase(EARGF(usage()), 1, INT_MAX, 10);
+		break;
 	case 'r': case 'w': case 'x':
 	case 'X': case 's': case 't':
 		argv[0]--; /* recover lost char */
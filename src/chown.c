@@ -13,8 +13,8 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-	        "usage: %s [-h] [-R [-H|-L|-P]] owner[:group] file ...\n"
-	        "       %s [-h] [-R [-H|-L|-P]] :group file ...\n",
+	        "usage: %s [-h] [-R [-H|-L|-P] [-j jobs]] owner[:group] file ...\n"
+	        "       %s [-h] [-R [-H|-L|-P] [-j jobs]] :group file ...\n",
 	        getprogname(), getprogname());
 	exit(1);
 }
@@ -48,6 +48,9 @@ main(int argc, char *argv[])
 	case 'P':
 		fs_follow = ARGC();
 		break;
+	case 'j':
+		fs_jobs = strtobase(EARGF(usage()), 1, INT_MAX, 10);
+		break;
 	default:
 		usage();
 	} ARGEND
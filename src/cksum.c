@@ -65,13 +65,17 @@ static void
 cksum(int fd, const char *fname)
 {
 	ssize_t fsize, i, rf;
+	size_t len;
 	unsigned sum;
-	unsigned char buf[BUFSIZ];
+	unsigned char *buf;
 
+	buf   = (unsigned char *)iobuf();
+	len   = iosize(fd);
 	fsize = 0;
 	sum   = 0;
+	ioadvise(fd);
 
-	while ((rf = read(fd, buf, sizeof(buf))) > 0) {
+	while ((rf = read(fd, buf, len)) > 0) {
 		fsize += rf;
 		for (i = 0; i < rf; i++)
 			sum = (sum << 8) ^ crctab[(sum >> 24) ^ buf[i]];
@@ -79,6 +83,7 @@ cksum(int fd, const char *fname)
 
 	if (rf < 0)
 		err(1, "read %s", fname);
+	iodone(fd);
 
 	for (i = fsize; i; i >>= 8)
 		sum = (sum << 8) ^ crctab[(sum >> 24) ^ (i & 0xFF)];
@@ -43,11 +43,13 @@ main(int argc, char *argv[])
 				warn("fopen %s", argv[i]);
 			exit(2);
 		}
+		setvbuf(fp[i], NULL, _IOFBF, iosize(fileno(fp[i])));
+		ioadvise(fileno(fp[i]));
 	}
 
 	for (line = i = 1;; i++) {
-		ch[0] = getc(fp[0]);
-		ch[1] = getc(fp[1]);
+		ch[0] = getc_unlocked(fp[0]);
+		ch[1] = getc_unlocked(fp[1]);
 
 		if (ch[0] == EOF || ch[1] == EOF)
 			break;
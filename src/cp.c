@@ -2,17 +2,24 @@
 
 #include <err.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "crypto.h"
 #include "util.h"
 
 static void
 usage(void)
 {
 	fprintf(stderr,
-	        "usage: %s [-fp] [-R [-H|-L|-P]] source target\n"
-	        "       %s [-fp] [-R [-H|-L|-P]] source ... dir\n",
+	        "usage: %s [-fpu] [--checksum] [--reflink[=when]] "
+	        "[--sparse=when] [--verify=hash] [-R [-H|-L|-P] [-j jobs]] "
+	        "source target\n"
+	        "       %s [-fpu] [--checksum] [--reflink[=when]] "
+	        "[--sparse=when] [--verify=hash] [-R [-H|-L|-P] [-j jobs]] "
+	        "source ... dir\n",
 	        getprogname(), getprogname());
 	exit(1);
 }
@@ -20,13 +27,14 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
+	struct crypto h;
 	struct stat st;
 	int (*cp)(const char *, const char *, int, int);
 	int opts, rval;
-	char *sourcedir, buf[PATH_MAX];
+	char *p, *sourcedir, buf[PATH_MAX];
 
 	cp   = cpfile;
-	opts = 0;
+	opts = CP_RAUTO;
 	rval = 0;
 	setprogname(argv[0]);
 
@@ -37,6 +45,9 @@ main(int argc, char *argv[])
 	case 'p':
 		opts |= CP_PFLAG;
 		break;
+	case 'u':
+		opts |= CP_UPDATE|CP_NEWER;
+		break;
 	case 'r':
 	case 'R':
 		cp = cpdir;
@@ -46,10 +57,44 @@ main(int argc, char *argv[])
 	case 'P':
 		fs_follow = ARGC();
 		break;
+	case 'j':
+		fs_jobs = strtobase(EARGF(usage()), 1, INT_MAX, 10);
+		break;
+	case '-':
+		p = EARGF(usage());
+		if (!strncmp(p, "reflink", 7))
+			opts &= ~(CP_RAUTO|CP_RALWAYS|CP_RNEVER);
+		else if (!strncmp(p, "sparse=", 7))
+			opts &= ~(CP_SALWAYS|CP_SNEVER);
+
+		if (!strcmp(p, "reflink") || !strcmp(p, "reflink=always"))
+			opts |= CP_RALWAYS;
+		else if (!strcmp(p, "reflink=auto"))
+			opts |= CP_RAUTO;
+		else if (!strcmp(p, "reflink=never"))
+			opts |= CP_RNEVER;
+		else if (!strcmp(p, "sparse=always"))
+			opts |= CP_SALWAYS;
+		else if (!strcmp(p, "sparse=never"))
+			opts |= CP_SNEVER;
+		else if (!strcmp(p, "checksum"))
+			opts |= CP_UPDATE|CP_SUM;
+		else if (!strncmp(p, "verify=", 7)) {
+			cp_verify = p + 7;
+			if (crypto_byname(&h, cp_verify) < 0)
+				usage();
+		}
+		else if (strcmp(p, "sparse=auto"))
+			usage();
+		break;
 	default:
 		usage();
 	} ARGEND
 
+	/* a clone shares the blocks, there would be nothing to check */
+	if (cp_verify)
+		opts = (opts & ~(CP_RAUTO|CP_RALWAYS)) | CP_RNEVER;
+
 	switch (argc) {
 	case 0:
 	case 1:
@@ -3,6 +3,7 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,61 +16,78 @@ enum Flags {
 	XFLAG = 0x04
 };
 
+/* blocks only, stale attributes are fine for an estimate */
+#define DU_NEED (FS_TYPE|FS_BLOCKS|FS_NOSYNC|FS_INOSORT)
+
 static int  opts;
 static long blocksize = 512;
 
-#define display(a, b) \
-printf("%jd\t%s\n", (b), (a));
+#define display(a, b, c) \
+fprintf((a), "%jd\t%s\n", (intmax_t)(c), (b))
+
+static int
+visit(FS_NODE *n, FS_DIR *dir)
+{
+	off_t sbt;
+
+	if (ISDOT(dir->name) ||
+	    ((opts & XFLAG) && dir->dev != dir->info.st_dev))
+		return FS_OK;
+
+	sbt = howmany(dir->info.st_blocks, blocksize);
+	n->total += sbt;
+
+	if (S_ISDIR(dir->info.st_mode))
+		return FS_EXEC;
+
+	if (opts & AFLAG)
+		display(n->out, dir->path, sbt);
+
+	return FS_OK;
+}
+
+static int
+post(FS_NODE *n)
+{
+	if (!n->depth)
+		display(n->out, n->path, n->total);
+	else if (!(opts & SFLAG))
+		display(n->out, n->path,
+		        n->total + howmany(n->info.st_blocks, blocksize));
+
+	return 0;
+}
 
 static int
-dudir(const char *path, int depth, off_t *n)
+dudir(const char *path, int depth)
 {
-	FS_DIR dir;
+	struct fs_walk w;
 	struct stat st;
 	off_t sbt;
-	int rd;
-
-	switch (open_dir(&dir, path)) {
-	case FS_ERR:
-		if (errno != ENOTDIR) {
-			warn("open_dir %s", path);
-			return 1;
-		}
-		if ((FS_FOLLOW(depth) ? stat : lstat)(path, &st) < 0) {
-			warn("(l)stat %s", path);
-			return 1;
-		}
-		sbt = howmany(st.st_blocks, blocksize);
-		display(path, sbt);
-		/* fallthrough */
-	case FS_CONT:
-		return 0;
-	}
+	int rval;
 
-	depth++;
-	while ((rd = read_dir(&dir)) == FS_EXEC) {
-		if (ISDOT(dir.name) ||
-		    ((opts & XFLAG) && st.st_dev != dir.info.st_dev))
-			continue;
-		sbt = howmany(dir.info.st_blocks, blocksize);
-		if (S_ISDIR(dir.info.st_mode)) {
-			dudir(dir.path, depth, &sbt);
-		} else if (opts & AFLAG) {
-			display(dir.path, sbt);
-		}
-		*n += sbt;
-	}
-	depth--;
+	w = (struct fs_walk){
+		.visit = visit,
+		.post  = post,
+		.need  = DU_NEED,
+	};
+
+	if ((rval = walk(path, &w)) != FS_ERR)
+		return rval;
 
-	close_dir(&dir);
+	if (errno != ENOTDIR) {
+		warn("open_dir %s", path);
+		return 1;
+	}
 
-	if (rd == FS_ERR) {
-		warn("read_dir %s", dir.path);
+	if (fs_stat(AT_FDCWD, path, &st, FS_FOLLOW(depth) ? 0 : AT_SYMLINK_NOFOLLOW,
+	    DU_NEED) < 0) {
+		warn("(l)stat %s", path);
 		return 1;
 	}
 
-	if (!depth || !(opts & SFLAG))
-		display(path, *n);
+	sbt = howmany(st.st_blocks, blocksize);
+	display(stdout, path, sbt);
 
 	return 0;
 }
@@ -77,7 +95,7 @@ dudir(const char *path, int depth, off_t *n)
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-kx] [-a|-s] [-H|-L] [file ...]\n",
+	fprintf(stderr, "usage: %s [-kx] [-a|-s] [-H|-L] [-j jobs] [file ...]\n",
 	        getprogname());
 	exit(1);
 }
@@ -85,7 +103,6 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
-	off_t n;
 	int kflag, rval;
 	const char *bsize;
 
@@ -110,6 +127,9 @@ main(int argc, char *argv[])
 	case 'L':
 		fs_follow = ARGC();
 		break;
+	case 'j':
+		fs_jobs = strtobase(EARGF(usage()), 1, INT_MAX, 10);
+		break;
 	default:
 		usage();
 	} ARGEND
@@ -121,16 +141,13 @@ main(int argc, char *argv[])
 		blocksize = strtobase(bsize, 1, LONG_MAX, 10);
 	blocksize /= 512;
 
-	n = 0;
 	rval = 0;
 
 	if (!argc)
-		rval = dudir(".", 0, &n);
+		rval = dudir(".", 0);
 
-	for (; *argv; argc--, argv++) {
-		n = 0;
-		rval |= dudir(*argv, 0, &n);
-	}
+	for (; *argv; argc--, argv++)
+		rval |= dudir(*argv, 0);
 
 	return (rval | ioshut());
 }
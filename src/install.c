@@ -3,11 +3,13 @@
 #include <grp.h>
 #include <limits.h>
 #include <pwd.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "crypto.h"
 #include "util.h"
 
 static int
@@ -25,12 +27,13 @@ static void
 usage(void)
 {
 	fprintf(stderr, "usage: %s [-cds] [-g group] [-m mode] [-o owner] "
-	        "source ... target\n", getprogname());
+	        "[--verify=hash] source ... target\n", getprogname());
 	exit(1);
 }
 int
 main(int argc, char *argv[])
 {
+	struct crypto h;
 	struct stat st;
 	struct passwd *pwd;
 	struct group *grp;
@@ -79,6 +82,13 @@ main(int argc, char *argv[])
 		else
 			err(1, "getpwnam %s", p);
 		break;
+	case '-':
+		p = EARGF(usage());
+		if (strncmp(p, "verify=", 7) ||
+		    crypto_byname(&h, p + 7) < 0)
+			usage();
+		cp_verify = p + 7;
+		break;
 	default:
 		usage();
 	} ARGEND
@@ -3,7 +3,9 @@
 #include <sys/types.h>
 
 #include <err.h>
+#include <fcntl.h>
 #include <grp.h>
+#include <limits.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,6 +57,12 @@ struct max {
 	size_t total;
 };
 
+struct listing {
+	struct arena arena; /* the files, released with the listing */
+	struct file *flist;
+	struct max max;
+};
+
 static int iflag;
 static int lflag;
 static int nflag;
@@ -68,11 +76,16 @@ static int Fpflag;
 static int Rdflag;
 static int Sftflag;
 
+static pthread_mutex_t idlock = PTHREAD_MUTEX_INITIALIZER;
+static struct arena args;
+
 static int first = 1;
+static int more;
+static int need  = FS_TYPE;
 static long blksiz = 512;
 static unsigned int termwidth = 80;
 
-static void (*printfcn)(struct file *, struct max *);
+static void (*printfcn)(FILE *, struct file *, struct max *);
 
 static int
 cmp(struct file *f1, struct file *f2)
@@ -95,16 +108,6 @@ cmp(struct file *f1, struct file *f2)
 	return (rflag ? (0 - cmp) : cmp);
 }
 
-static void
-freefile(struct file *p)
-{
-	free(p->name);
-	free(p->group);
-	free(p->link);
-	free(p->user);
-	free(p);
-}
-
 static struct file *
 mergelist(struct file *l1, struct file *l2)
 {
@@ -209,7 +212,7 @@ mkmax(struct max *max, struct file *file)
 }
 
 struct file *
-newfile(const char *path, const char *str, struct stat *info)
+newfile(struct arena *a, int fd, const char *str, struct stat *info)
 {
 	struct file *new;
 	struct stat st;
@@ -219,8 +222,8 @@ newfile(const char *path, const char *str, struct stat *info)
 	char lp[PATH_MAX], group[32], user[32];
 
 	/* alloc/copy initial values */
-	new       = emalloc(1 * sizeof(*new));
-	new->name = estrdup(str);
+	new       = arena_alloc(a, sizeof(*new));
+	new->name = arena_strdup(a, str);
 	new->len  = strlen(str);
 	new->st   = *info;
 
@@ -241,25 +244,26 @@ newfile(const char *path, const char *str, struct stat *info)
 		break;
 	}
 
-	if (S_ISLNK(new->st.st_mode)) {
-		if (stat(path, &st) == 0)
+	if (lflag && S_ISLNK(new->st.st_mode)) {
+		if (fs_stat(fd, str, &st, 0, FS_MODE) == 0)
 			new->tmode = st.st_mode;
 		else
 			new->tmode = 0;
 
-		if ((len = readlink(path, lp, sizeof(lp) - 1)) < 0) {
-			warn("readlink %s", path);
-			freefile(new);
+		if ((len = readlinkat(fd, str, lp, sizeof(lp) - 1)) < 0) {
+			warn("readlink %s", str);
 			return NULL;
 		}
 
 		lp[len] = '\0';
-		new->link = estrdup(lp);
+		new->link = arena_strdup(a, lp);
 	}
 
 	if (!lflag)
 		return new;
 
+	/* the group and password entries are shared by the walkers */
+	pthread_mutex_lock(&idlock);
 	if (!nflag && (pw = getpwuid(new->st.st_uid)))
 		snprintf(user, sizeof(user), "%s", pw->pw_name);
 	else
@@ -269,26 +273,16 @@ newfile(const char *path, const char *str, struct stat *info)
 		snprintf(group, sizeof(group), "%s", gr->gr_name);
 	else
 		snprintf(group, sizeof(group), "%d", new->st.st_gid);
+	pthread_mutex_unlock(&idlock);
 
-	new->group = estrdup(group);
-	new->user  = estrdup(user);
+	new->group = arena_strdup(a, group);
+	new->user  = arena_strdup(a, user);
 	new->glen  = strlen(group);
 	new->ulen  = strlen(user);
 
 	return new;
 }
 
-struct file *
-popfile(struct file **p)
-{
-	struct file *old;
-
-	old = *p;
-	*p = old->next;
-
-	return old;
-}
-
 static void
 pushfile(struct file **p, struct file *new)
 {
@@ -298,25 +292,25 @@ pushfile(struct file **p, struct file *new)
 
 /* internal print functions */
 static int
-ptype(mode_t mode)
+ptype(FILE *fp, mode_t mode)
 {
 	switch (mode & S_IFMT) {
 	case S_IFDIR:
-		putchar('/');
+		putc('/', fp);
 		return 1;
 	case S_IFIFO:
-		putchar('|');
+		putc('|', fp);
 		return 1;
 	case S_IFLNK:
-		putchar('@');
+		putc('@', fp);
 		return 1;
 	case S_IFSOCK:
-		putchar('=');
+		putc('=', fp);
 		return 1;
 	}
 
 	if (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) {
-		putchar('*');
+		putc('*', fp);
 		return 1;
 	}
 
@@ -324,7 +318,7 @@ ptype(mode_t mode)
 }
 
 static void
-pmode(struct stat *st)
+pmode(FILE *fp, struct stat *st)
 {
 	char mode[11];
 
@@ -381,11 +375,11 @@ pmode(struct stat *st)
 	if (st->st_mode & S_ISVTX)
 		mode[9] = (mode[9] == 'x') ? 't' : 'T';
 
-	printf("%s ", mode);
+	fprintf(fp, "%s ", mode);
 }
 
 static int
-pname(struct file *file, int ino, int size)
+pname(FILE *fp, struct file *file, int ino, int size)
 {
 	Rune rune;
 	int chcnt, len;
@@ -395,31 +389,31 @@ pname(struct file *file, int ino, int size)
 	len   = 0;
 
 	if (iflag && ino)
-		chcnt += printf("%*llu ", ino,
-		                (unsigned long long)file->st.st_ino);
+		chcnt += fprintf(fp, "%*llu ", ino,
+		                 (unsigned long long)file->st.st_ino);
 	if (sflag && size)
-		chcnt += printf("%*lld ", size,
-		                howmany((long long)file->st.st_blocks, blksiz));
+		chcnt += fprintf(fp, "%*lld ", size,
+		                 howmany((long long)file->st.st_blocks, blksiz));
 
 	for (ch = file->name; *ch; ch += len) {
 		len = chartorune(&rune, ch);
 
 		if (!qflag || isprintrune(rune))
-			chcnt += fwrite(ch, sizeof(char), len, stdout);
+			chcnt += fwrite(ch, sizeof(char), len, fp);
 		else
-			chcnt += fwrite("?", sizeof(char), 1, stdout);
+			chcnt += fwrite("?", sizeof(char), 1, fp);
 	}
 
 	if (Fpflag == 'F' || (Fpflag == 'p' && S_ISDIR(file->st.st_mode)))
-		chcnt += ptype(file->st.st_mode);
+		chcnt += ptype(fp, file->st.st_mode);
 
 	return chcnt;
 }
 
 static void
-ptime(struct timespec t)
+ptime(FILE *fp, struct timespec t)
 {
-	struct tm *tm;
+	struct tm *tm, tmb;
 	char *fmt, buf[DATELEN];
 
 	if (NOW > (t.tv_sec + SIXMONTHS))
@@ -427,58 +421,58 @@ ptime(struct timespec t)
 	else
 		fmt = "%b %d %H:%M";
 
-	if ((tm = localtime(&t.tv_sec)))
+	if ((tm = localtime_r(&t.tv_sec, &tmb)))
 		strftime(buf, sizeof(buf), fmt, tm);
 	else
 		snprintf(buf, sizeof(buf), "%lld", (long long)t.tv_sec);
 
-	printf("%s ", buf);
+	fprintf(fp, "%s ", buf);
 }
 
 /* external print functions */
 static void
-print1(struct file *flist, struct max *max)
+print1(FILE *fp, struct file *flist, struct max *max)
 {
 	struct file *p;
 
 	for (p = flist; p; p = p->next) {
 		if (!lflag) {
-			pname(p, max->s_ino, max->s_block);
+			pname(fp, p, max->s_ino, max->s_block);
 			goto next;
 		}
 
 		if (iflag)
-			printf("%*llu ", max->s_ino,
-			       (unsigned long long)p->st.st_ino);
+			fprintf(fp, "%*llu ", max->s_ino,
+			        (unsigned long long)p->st.st_ino);
 		if (sflag)
-			printf("%*lld ", max->s_block,
-			       howmany((long long)p->st.st_blocks, blksiz));
+			fprintf(fp, "%*lld ", max->s_block,
+			        howmany((long long)p->st.st_blocks, blksiz));
 
-		pmode(&p->st);
-		printf("%*lu %-*s %-*s ", max->s_nlink, p->st.st_nlink,
-		       max->s_uid, p->user, max->s_gid, p->group);
+		pmode(fp, &p->st);
+		fprintf(fp, "%*lu %-*s %-*s ", max->s_nlink, p->st.st_nlink,
+		        max->s_uid, p->user, max->s_gid, p->group);
 
 		if (S_ISBLK(p->st.st_mode) || S_ISCHR(p->st.st_mode))
-			printf("%3d, %3d ",
-			       major(p->st.st_rdev), minor(p->st.st_rdev));
+			fprintf(fp, "%3d, %3d ",
+			        major(p->st.st_rdev), minor(p->st.st_rdev));
 		else
-			printf("%*s%*lld ", 8 - max->s_size, "",
-			       max->s_size, (long long)p->st.st_size);
+			fprintf(fp, "%*s%*lld ", 8 - max->s_size, "",
+			        max->s_size, (long long)p->st.st_size);
 
-		ptime(p->tm);
-		pname(p, 0, 0);
+		ptime(fp, p->tm);
+		pname(fp, p, 0, 0);
 
 		if (S_ISLNK(p->st.st_mode)) {
-			printf(" -> %s", p->link);
-			ptype(p->tmode);
+			fprintf(fp, " -> %s", p->link);
+			ptype(fp, p->tmode);
 		}
 next:
-		putchar('\n');
+		putc('\n', fp);
 	}
 }
 
 static void
-printc(struct file *flist, struct max *max)
+printc(FILE *fp, struct file *flist, struct max *max)
 {
 	struct file **pa, *p;
 	struct column cols;
@@ -490,7 +484,7 @@ printc(struct file *flist, struct max *max)
 	num   = 0;
 
 	if (mkcol(&cols, max)) {
-		print1(flist, max);
+		print1(fp, flist, max);
 		return;
 	}
 
@@ -507,13 +501,13 @@ printc(struct file *flist, struct max *max)
 
 	for (; row < nrows; row++) {
 		for (base = row, col = 0; col < cols.num; col++) {
-			chcnt = pname(pa[base], max->s_ino, max->s_block);
+			chcnt = pname(fp, pa[base], max->s_ino, max->s_block);
 			if ((base += nrows) >= num)
 				break;
 			while (chcnt++ < cols.width)
-				putchar(' ');
+				putc(' ', fp);
 		}
-		putchar('\n');
+		putc('\n', fp);
 	}
 
 	free(pa);
@@ -521,7 +515,7 @@ printc(struct file *flist, struct max *max)
 }
 
 static void
-printm(struct file *flist, struct max *max)
+printm(FILE *fp, struct file *flist, struct max *max)
 {
 	struct file *p;
 	int chcnt, width;
@@ -538,21 +532,21 @@ printm(struct file *flist, struct max *max)
 
 	for (p = flist; p; p = p->next) {
 		if (chcnt > 0) {
-			putchar(',');
+			putc(',', fp);
 			if ((chcnt += 3) + width + p->len >= termwidth)
-				putchar('\n'), chcnt = 0;
+				putc('\n', fp), chcnt = 0;
 			else
-				putchar(' ');
+				putc(' ', fp);
 		}
 
-		chcnt += pname(p, max->s_ino, max->s_block);
+		chcnt += pname(fp, p, max->s_ino, max->s_block);
 	}
 
-	putchar('\n');
+	putc('\n', fp);
 }
 
 static void
-printx(struct file *flist, struct max *max)
+printx(FILE *fp, struct file *flist, struct max *max)
 {
 	struct file *p;
 	struct column cols;
@@ -562,105 +556,125 @@ printx(struct file *flist, struct max *max)
 	col   = 0;
 
 	if (mkcol(&cols, max)) {
-		print1(flist, max);
+		print1(fp, flist, max);
 		return;
 	}
 
 	for (p = flist; p; p = p->next, col++) {
 		if (col >= cols.num) {
 			col = 0;
-			putchar('\n');
+			putc('\n', fp);
 		}
 
-		chcnt = pname(p, max->s_ino, max->s_block);
+		chcnt = pname(fp, p, max->s_ino, max->s_block);
 		while (chcnt++ < cols.width)
-			putchar(' ');
+			putc(' ', fp);
 	}
 
-	putchar('\n');
+	putc('\n', fp);
 }
 
 static void
-print_list(struct file **flist, struct max *max)
+print_list(FILE *fp, struct file **flist, struct max *max)
 {
 	if (sflag || iflag || lflag)
-		printf("total: %lu\n",
-		       howmany((long unsigned)max->btotal, blksiz));
+		fprintf(fp, "total: %lu\n",
+		        howmany((long unsigned)max->btotal, blksiz));
 
 	mkmax(max, NULL);
-	printfcn(*flist, max);
+	printfcn(fp, *flist, max);
 }
 
 static int
-lsdir(const char *path, int more, int depth)
+pre(FS_NODE *n)
 {
-	FS_DIR dir;
-	struct file *flist, *p;
-	struct max max;
-	int rd;
-	char npath[PATH_MAX];
+	struct listing *l;
 
-	flist = NULL;
-	memset(&max, 0, sizeof(max));
-
-	switch (open_dir(&dir, path)) {
-	case FS_ERR:
-		warn("open_dir %s", path);
-		return 1;
-	case FS_CONT:
-		return 0;
-	}
+	l = emalloc(sizeof(*l));
+	memset(l, 0, sizeof(*l));
+	n->data = l;
 
 	if (more || Rdflag == 'R')
-		printf((first-- == 1) ? "%s:\n" : "\n%s:\n", path);
+		fprintf(n->out, (n->depth || !first) ? "\n%s:\n" : "%s:\n",
+		        n->path);
 
-	depth++;
-	while ((rd = read_dir(&dir)) == FS_EXEC) {
-		if (Aaflag != 'a' && ISDOT(dir.name))
-			continue;
+	return FS_OK;
+}
 
-		if (!Aaflag && dir.name[0] == '.')
-			continue;
+static int
+visit(FS_NODE *n, FS_DIR *dir)
+{
+	struct listing *l;
+	struct file *p;
 
-		if (!(p = newfile(dir.path, dir.name, &dir.info)))
-			continue;
-		pushfile(&flist, p);
-		mkmax(&max, flist);
-	}
-	depth--;
+	if (Aaflag != 'a' && ISDOT(dir->name))
+		return FS_OK;
 
-	close_dir(&dir);
+	if (!Aaflag && dir->name[0] == '.')
+		return FS_OK;
 
-	if (rd == FS_ERR)
-		warn("read_dir %s", dir.path);
+	l = n->data;
+	if (!(p = newfile(&l->arena, dir->fd, dir->name, &dir->info)))
+		return FS_OK;
 
-	if (flist && flist->next && Sftflag != 'f')
-		_mergesort(&flist);
+	pushfile(&l->flist, p);
+	mkmax(&l->max, l->flist);
 
-	if (max.total)
-		print_list(&flist, &max);
+	return FS_OK;
+}
+
+static void
+scan(FS_NODE *n)
+{
+	struct listing *l;
+	struct file *p;
+
+	l = n->data;
+
+	if (l->flist && l->flist->next && Sftflag != 'f')
+		_mergesort(&l->flist);
+
+	if (l->max.total)
+		print_list(n->out, &l->flist, &l->max);
 
 	if (Rdflag == 'R') {
-		for (p = flist; p; p = p->next) {
-			if (ISDOT(p->name))
-				continue;
-			if (!S_ISDIR(p->st.st_mode))
-				continue;
-			snprintf(npath, sizeof(npath), "%s/%s", path, p->name);
-			lsdir(npath, more, depth+1);
+		for (p = l->flist; p; p = p->next) {
+			if (S_ISDIR(p->st.st_mode))
+				walk_push(n, p->name, &p->st);
 		}
 	}
 
-	while (flist)
-		freefile(popfile(&flist));
+	arena_reset(&l->arena);
+	free(l);
+}
 
-	return 0;
+static int
+lsdir(const char *path)
+{
+	struct fs_walk w;
+	int rval;
+
+	w = (struct fs_walk){
+		.pre   = pre,
+		.visit = visit,
+		.scan  = scan,
+		.need  = need,
+	};
+
+	if ((rval = walk(path, &w)) == FS_ERR) {
+		warn("open_dir %s", path);
+		return 1;
+	}
+
+	first = 0;
+
+	return rval;
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-1AaCcFfiklmnpqrSstux] [file ...]\n",
+	fprintf(stderr, "usage: %s [-1AaCcFfiklmnpqrSstux] [-j jobs] [file ...]\n",
 	        getprogname());
 	exit(1);
 }
@@ -671,7 +685,7 @@ main(int argc, char *argv[])
 	struct file *dlist, *flist, *p;
 	struct stat st;
 	struct max max;
-	int kflag, more, rval;
+	int kflag, rval;
 	char *temp;
 
 	dlist    = NULL;
@@ -686,6 +700,9 @@ main(int argc, char *argv[])
 	case 'i':
 		iflag = 1;
 		break;
+	case 'j':
+		fs_jobs = strtobase(EARGF(usage()), 1, INT_MAX, 10);
+		break;
 	case 'k':
 		kflag = 1;
 		break;
@@ -747,6 +764,21 @@ main(int argc, char *argv[])
 	if ((printfcn != print1) && lflag)
 		lflag = 0;
 
+	if (lflag)
+		need |= FS_STAT;
+	if (iflag)
+		need |= FS_INO|FS_BLOCKS;
+	if (sflag)
+		need |= FS_BLOCKS;
+	if (Fpflag == 'F')
+		need |= FS_MODE;
+	if (Sftflag == 'S')
+		need |= FS_SIZE;
+	if (Sftflag == 't')
+		need |= FS_TIME;
+	if (need & FS_STAT)
+		need |= FS_INOSORT;
+
 	if (lflag || sflag) {
 		if (!kflag && (temp = getenv("BLOCKSIZE")))
 			blksiz = strtobase(temp, 1, LONG_MAX, 10);
@@ -765,13 +797,14 @@ main(int argc, char *argv[])
 	}
 
 	for (; *argv; argv++) {
-		if ((FS_FOLLOW(0) ? stat : lstat)(*argv, &st) < 0) {
+		if (fs_stat(AT_FDCWD, *argv, &st,
+		    FS_FOLLOW(0) ? 0 : AT_SYMLINK_NOFOLLOW, need) < 0) {
 			warn("(l)stat %s", *argv);
 			rval = 1;
 			continue;
 		}
 
-		if (!(p = newfile(*argv, *argv, &st)))
+		if (!(p = newfile(&args, AT_FDCWD, *argv, &st)))
 			continue;
 		if (Rdflag != 'd' && S_ISDIR(st.st_mode)) {
 			pushfile(&dlist, p);
@@ -788,16 +821,13 @@ main(int argc, char *argv[])
 
 	if (max.total) {
 		first = 0;
-		print_list(&flist, &max);
+		print_list(stdout, &flist, &max);
 	}
 
 	for (more = argc > 1, p = dlist; p; p = p->next)
-		rval |= lsdir(p->name, more, 0);
+		rval |= lsdir(p->name);
 
-	while (flist)
-		freefile(popfile(&flist));
-	while (dlist)
-		freefile(popfile(&dlist));
+	arena_reset(&args);
 
 	return (rval | ioshut());
 }
@@ -1,33 +1,184 @@
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "util.h"
 
+#define JOURNAL ".mvjournal"
+
+enum {
+	PCOPY = 'c' /* the target is being filled, the source emptied */
+};
+
+/* both ends on the same kind of filesystem, which may clone across them */
+static int
+samefs(const char *src, const char *dest)
+{
+#ifdef __linux__
+	struct statfs s1, s2;
+	char buf[PATH_MAX];
+
+	snprintf(buf, sizeof(buf), "%s", dest);
+	if (statfs(src, &s1) < 0 || statfs(dirname(buf), &s2) < 0)
+		return 0;
+
+	return s1.f_type == s2.f_type;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * a move across devices keeps a journal beside the target: the phase
+ * byte followed by the source path. each source directory is removed as
+ * soon as its copy is on disk, so an interrupted move is picked up by
+ * copying what is left, skipping files an earlier attempt finished.
+ */
+static int
+jstart(const char *jpath, const char *src)
+{
+	size_t len;
+	int fd;
+
+	if ((fd = open(jpath, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600)) < 0) {
+		warn("open %s", jpath);
+		return -1;
+	}
+
+	len = strlen(src);
+	if (write(fd, "c", 1) != 1 || write(fd, src, len) != (ssize_t)len ||
+	    fsync(fd) < 0) {
+		warn("write %s", jpath);
+		close(fd);
+		unlink(jpath);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+jread(int fd, const char *jpath, const char *src)
+{
+	ssize_t n;
+	char buf[PATH_MAX + 1];
+
+	if ((n = read(fd, buf, sizeof(buf) - 1)) < 0) {
+		warn("read %s", jpath);
+		return -1;
+	}
+	buf[(n > 0) ? n : 0] = '\0';
+
+	if (buf[0] != PCOPY || strcmp(buf + 1, src)) {
+		warnx("%s: journal of another move", jpath);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* a file or link is copied and unlinked, it has nothing to resume */
+static int
+movefile(const char *src, const char *dest, int opts)
+{
+	if (cpfile(src, dest, opts|CP_FFLAG, 0))
+		return 1;
+
+	return delfile(src, 0);
+}
+
 static int
 move(const char *src, const char *dest)
 {
+	struct stat st;
+	int error, fd, jlen, opts, rval;
+	char jpath[PATH_MAX];
+
 	if (!rename(src, dest))
 		return 0;
+	error = errno;
 
-	if (errno == EXDEV)
-		return (cpdir(src, dest, 0, CP_PFLAG));
-	else
+	/* an interrupted move left its journal, whatever rename said */
+	fd   = -1;
+	jlen = snprintf(jpath, sizeof(jpath), "%s%s", dest, JOURNAL);
+	if (jlen < (int)sizeof(jpath))
+		fd = open(jpath, O_RDWR|O_CLOEXEC);
+
+	if (fd < 0 && error != EXDEV) {
+		errno = error;
 		warn("rename %s -> %s", src, dest);
+		return 1;
+	}
+
+	opts = CP_PFLAG | CP_MOVE | (samefs(src, dest) ? CP_RAUTO : 0);
 
-	return 1;
+	if (fd >= 0) {
+		if (jread(fd, jpath, src) < 0) {
+			close(fd);
+			return 1;
+		}
+		/* files completed by an earlier attempt are not copied again */
+		opts |= CP_UPDATE;
+	} else {
+		if (lstat(src, &st) < 0) {
+			warn("lstat %s", src);
+			return 1;
+		}
+
+		/* a link to a directory is moved as the link, never walked */
+		if (!S_ISDIR(st.st_mode))
+			return movefile(src, dest, opts & ~CP_MOVE);
+
+		if (jlen >= (int)sizeof(jpath)) {
+			errno = ENAMETOOLONG;
+			warn("%s", dest);
+			return 1;
+		}
+
+		if ((fd = jstart(jpath, src)) < 0)
+			return 1;
+	}
+	close(fd);
+
+	/* the last attempt may have removed the source and stopped there */
+	rval = 0;
+	if (lstat(src, &st) < 0) {
+		if (errno != ENOENT) {
+			warn("lstat %s", src);
+			return 1;
+		}
+	} else if (!S_ISDIR(st.st_mode)) {
+		warnx("%s: not a directory, not resuming", src);
+		return 1;
+	} else {
+		rval = cpdir(src, dest, opts, 0);
+	}
+
+	if (!rval && unlink(jpath) < 0) {
+		warn("unlink %s", jpath);
+		rval = 1;
+	}
+
+	return rval;
 }
 
 static void
 usage(void)
 {
 	fprintf(stderr,
-	        "usage: %s [-f] source target\n"
-	        "       %s [-f] source ... directory\n",
+	        "usage: %s [-f] [-j jobs] source target\n"
+	        "       %s [-f] [-j jobs] source ... directory\n",
 	        getprogname(), getprogname());
 	exit(1);
 }
@@ -45,6 +196,9 @@ main(int argc, char *argv[])
 	ARGBEGIN {
 	case 'f':
 		break;
+	case 'j':
+		fs_jobs = strtobase(EARGF(usage()), 1, INT_MAX, 10);
+		break;
 	default:
 		usage();
 	} ARGEND
@@ -54,6 +208,10 @@ main(int argc, char *argv[])
 	case 1:
 		usage();
 	case 2:
+		/* the target an interrupted move made is not a directory to enter */
+		snprintf(buf, sizeof(buf), "%s%s", argv[1], JOURNAL);
+		if (access(buf, F_OK) == 0)
+			exit(move(argv[0], argv[1]));
 		pathcat(buf, argv[0], argv[1]);
 		exit(move(argv[0], buf));
 	}
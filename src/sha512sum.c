@@ -1,4 +1,5 @@
 #include <err.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,7 +10,7 @@
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-c] [file ...]\n", getprogname());
+	fprintf(stderr, "usage: %s [-c] [-j jobs] [file ...]\n", getprogname());
 	exit(1);
 }
 
@@ -19,17 +20,20 @@ main(int argc, char *argv[])
 	struct crypto p;
 	union hash_state md;
 	FILE *fp;
-	int (*fn)(struct crypto *, FILE *, const char *);
-	int rval;
+	int cflag, jobs, rval;
 	uint8_t buf[64];
 
-	fn   = crypto_print;
-	rval = 0;
+	cflag = 0;
+	jobs  = 1;
+	rval  = 0;
 	setprogname(argv[0]);
 
 	ARGBEGIN {
 	case 'c':
-		fn = crypto_check;
+		cflag = 1;
+		break;
+	case 'j':
+		jobs = strtobase(EARGF(usage()), 1, INT_MAX, 10);
 		break;
 	default:
 		usage();
@@ -41,11 +45,15 @@ main(int argc, char *argv[])
 		.process  = sha512_process,
 		.done     = sha512_done,
 		.buf      = buf,
+		.jobs     = jobs,
 		.bsiz     = sizeof(buf),
 	};
 
+	if (!cflag)
+		return (crypto_print(&p, argv, argc) | ioshut());
+
 	if (!argc)
-		fn(&p, stdin, "<stdin>");
+		rval = crypto_check(&p, stdin, "<stdin>");
 
 	for (; *argv; argc--, argv++) {
 		if (ISDASH(*argv)) {
@@ -56,9 +64,9 @@ main(int argc, char *argv[])
 			rval = 1;
 			continue;
 		}
-		rval |= fn(&p, fp, *argv);
+		rval |= crypto_check(&p, fp, *argv);
 		fclose(fp);
 	}
 
-	return (ioshut());
+	return (rval | ioshut());
 }
@@ -18,9 +18,10 @@ int
 main(int argc, char *argv[])
 {
 	ssize_t n;
+	size_t len;
 	mode_t mode;
 	int *fds, fdslen, i, rval;
-	char buf[BUFSIZ];
+	char *buf;
 
 	mode = O_WRONLY|O_CREAT|O_TRUNC;
 	rval = 0;
@@ -46,7 +47,11 @@ main(int argc, char *argv[])
 
 	fds[i] = STDOUT_FILENO;
 
-	while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+	buf = iobuf();
+	len = iosize(STDIN_FILENO);
+	ioadvise(STDIN_FILENO);
+
+	while ((n = read(STDIN_FILENO, buf, len)) > 0) {
 		for (i = 0; i < fdslen; i++)
 			if (write(fds[i], buf, n) != n)
 				err(1, "write %s", (i < fdslen)
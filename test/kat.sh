@@ -0,0 +1,47 @@
+#!/bin/sh
+# known answers for sha*sum, through every code path this machine has:
+# the portable code, the SHA extensions, the AVX2 lanes and SHA-512.
+# each file is hashed alone through stdin, all of them together through
+# the lanes, and on threads with -j.
+
+dir=$(dirname "$0")
+kat="$dir/kat"
+bin=$(cd "$dir/../src" && pwd) || exit 1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+for n in $(awk '!/^#/ { print $2 }' "$kat" | sort -un); do
+	awk -v n="$n" 'BEGIN { for (i = 0; i < n; i++) printf "%c", 33 + i % 94 }' \
+	    > "$tmp/$n"
+done
+
+fail=0
+check() {
+	# $1 what, $2 alg, $3 length, $4 digest printed
+	want=$(awk -v a="$2" -v n="$3" '$1 == a && $2 == n { print $3 }' "$kat")
+	if [ "$4" != "$want" ]; then
+		echo "FAIL $1 $2 $3: $4" >&2
+		fail=1
+	fi
+}
+
+for simd in '' sha avx2 1; do
+	UTILCHEST_NOSIMD=$simd
+	export UTILCHEST_NOSIMD
+	for alg in sha1 sha224 sha256 sha512; do
+		lens=$(awk -v a="$alg" '$1 == a { print $2 }' "$kat")
+		for n in $lens; do
+			check "nosimd=$simd stdin" $alg $n \
+			    "$("$bin/${alg}sum" < "$tmp/$n" | cut -d' ' -f1)"
+		done
+		for j in 1 3; do
+			(cd "$tmp" && "$bin/${alg}sum" -j $j $lens) > "$tmp/out"
+			while read -r sum n; do
+				check "nosimd=$simd -j$j" $alg $n "$sum"
+			done < "$tmp/out"
+		done
+	done
+done
+
+[ $fail = 0 ] && echo "kat: ok"
+exit $fail